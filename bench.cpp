@@ -0,0 +1,205 @@
+// Copyright (c) 2009 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+#include "headers.h"
+
+
+//
+// Standalone benchmark of signature verification.  Builds a transaction
+// of the requested shape, signs every input and times CKey::Verify,
+// SignatureHash and the full VerifySignature/EvalScript of each input,
+// then a script of small number arithmetic and one of deeply nested IFs.
+//
+//   bench [-inputs=<n>] [-outputs=<n>] [-hashtype=all|none|single[+anyonecanpay]]
+//         [-script=hash|pubkey] [-seconds=<n>] [-sigcache] [-nonative]
+//
+// The signature cache is off unless -sigcache is given, so repeated checks
+// of the same inputs measure the real work.
+//
+
+// script.o and util.o only need these from main.o and net.o
+map<vector<unsigned char>, CPrivKey> mapKeys;
+map<uint160, vector<unsigned char> > mapPubKeys;
+CCriticalSection cs_mapKeys;
+vector<CNode*> vNodes;
+SOCKET hListenSocket = INVALID_SOCKET;
+
+
+struct CBenchInput
+{
+    vector<unsigned char> vchPubKey;
+    vector<unsigned char> vchSig;
+    uint256 hash;
+    int nHashType;
+};
+
+static int64 nBenchMillis = 2000;
+
+// Runs pfn over the inputs until nBenchMillis have passed, prints the rate per input
+static void RunBench(const char* pszName, bool (*pfn)(const CTransaction&, const CTransaction&, const vector<CBenchInput>&, int),
+                     const CTransaction& txFrom, const CTransaction& txTo, const vector<CBenchInput>& vInputs)
+{
+    int64 nCount = 0;
+    int64 nStart = GetTimeMillis();
+    int64 nElapsed = 0;
+    bool fOk = true;
+    do
+    {
+        for (int i = 0; i < vInputs.size(); i++)
+            fOk &= pfn(txFrom, txTo, vInputs, i);
+        nCount += vInputs.size();
+        nElapsed = GetTimeMillis() - nStart;
+    }
+    while (nElapsed < nBenchMillis);
+    printf("%-18s %10.0f per second%s\n", pszName, nCount * 1000.0 / max(nElapsed, (int64)1), fOk ? "" : "  (FAILED)");
+}
+
+static bool BenchVerify(const CTransaction& txFrom, const CTransaction& txTo, const vector<CBenchInput>& vInputs, int i)
+{
+    return CKey::Verify(vInputs[i].vchPubKey, vInputs[i].hash, vInputs[i].vchSig);
+}
+
+static bool BenchSignatureHash(const CTransaction& txFrom, const CTransaction& txTo, const vector<CBenchInput>& vInputs, int i)
+{
+    return SignatureHash(txFrom.vout[i].scriptPubKey, txTo, i, vInputs[i].nHashType) == vInputs[i].hash;
+}
+
+static bool BenchEvalScript(const CTransaction& txFrom, const CTransaction& txTo, const vector<CBenchInput>& vInputs, int i)
+{
+    return VerifySignature(txFrom, txTo, i);
+}
+
+static CScript scriptArith;
+static CScript scriptNestedIf;
+
+static bool BenchArith(const CTransaction& txFrom, const CTransaction& txTo, const vector<CBenchInput>& vInputs, int i)
+{
+    return EvalScript(scriptArith, txTo, i);
+}
+
+static bool BenchNestedIf(const CTransaction& txFrom, const CTransaction& txTo, const vector<CBenchInput>& vInputs, int i)
+{
+    return EvalScript(scriptNestedIf, txTo, i);
+}
+
+int main(int argc, char* argv[])
+{
+    fPrintToConsole = true;
+    ParseParameters(argc, argv);
+    if (!mapArgs.count("-sigcache"))
+        mapArgs["-maxsigcachesize"] = "0";
+    printf("Using %s SHA-256\n", SHA256AutoDetect());
+    if (!mapArgs.count("-nonative"))
+        printf("Using %s ECDSA verification\n", Secp256k1AutoDetect());
+
+    int nInputs = 2;
+    int nOutputs = 2;
+    int nHashType = SIGHASH_ALL;
+    bool fPubKeyScript = false;
+    if (mapArgs.count("-inputs"))
+        nInputs = max(atoi(mapArgs["-inputs"]), 1);
+    if (mapArgs.count("-outputs"))
+        nOutputs = max(atoi(mapArgs["-outputs"]), 1);
+    if (mapArgs.count("-seconds"))
+        nBenchMillis = max(atoi(mapArgs["-seconds"]), 1) * 1000;
+    if (mapArgs.count("-script"))
+        fPubKeyScript = (mapArgs["-script"] == "pubkey");
+    if (mapArgs.count("-hashtype"))
+    {
+        string strType = mapArgs["-hashtype"];
+        if (strType.find("none") != string::npos)
+            nHashType = SIGHASH_NONE;
+        else if (strType.find("single") != string::npos)
+            nHashType = SIGHASH_SINGLE;
+        if (strType.find("anyonecanpay") != string::npos)
+            nHashType |= SIGHASH_ANYONECANPAY;
+    }
+    if ((nHashType & 0x1f) == SIGHASH_SINGLE && nOutputs < nInputs)
+    {
+        printf("SIGHASH_SINGLE needs at least as many outputs as inputs\n");
+        return 1;
+    }
+
+    // One key and one previous output per input
+    CTransaction txFrom;
+    txFrom.vin.resize(1);
+    txFrom.vin[0].scriptSig = CScript() << 486604799 << CBigNum(4);
+    for (int i = 0; i < nInputs; i++)
+    {
+        CKey key;
+        key.MakeNewKey();
+        vector<unsigned char> vchPubKey = key.GetPubKey();
+        mapKeys[vchPubKey] = key.GetPrivKey();
+        mapPubKeys[Hash160(vchPubKey)] = vchPubKey;
+
+        CScript scriptPubKey;
+        if (fPubKeyScript)
+            scriptPubKey << vchPubKey << OP_CHECKSIG;
+        else
+            scriptPubKey << OP_DUP << OP_HASH160 << Hash160(vchPubKey) << OP_EQUALVERIFY << OP_CHECKSIG;
+        txFrom.vout.push_back(CTxOut(50 * COIN, scriptPubKey));
+    }
+
+    CTransaction txTo;
+    for (int i = 0; i < nInputs; i++)
+        txTo.vin.push_back(CTxIn(txFrom.GetHash(), i));
+    for (int i = 0; i < nOutputs; i++)
+        txTo.vout.push_back(CTxOut(nInputs * 50 * COIN / nOutputs, txFrom.vout[i % nInputs].scriptPubKey));
+
+    vector<CBenchInput> vInputs(nInputs);
+    for (int i = 0; i < nInputs; i++)
+    {
+        if (!SignSignature(txFrom, txTo, i, nHashType))
+        {
+            printf("SignSignature failed on input %d\n", i);
+            return 1;
+        }
+    }
+    for (int i = 0; i < nInputs; i++)
+    {
+        // The signature is the first push of the scriptSig, the public key
+        // the second push or the one in scriptPubKey
+        CBenchInput& input = vInputs[i];
+        opcodetype opcode;
+        CScript::const_iterator pc = txTo.vin[i].scriptSig.begin();
+        txTo.vin[i].scriptSig.GetOp(pc, opcode, input.vchSig);
+        if (fPubKeyScript)
+        {
+            CScript::const_iterator pc2 = txFrom.vout[i].scriptPubKey.begin();
+            txFrom.vout[i].scriptPubKey.GetOp(pc2, opcode, input.vchPubKey);
+        }
+        else
+        {
+            txTo.vin[i].scriptSig.GetOp(pc, opcode, input.vchPubKey);
+        }
+        input.nHashType = input.vchSig.back();
+        input.vchSig.pop_back();
+        input.hash = SignatureHash(txFrom.vout[i].scriptPubKey, txTo, i, input.nHashType);
+    }
+
+    printf("%d inputs, %d outputs, hash type 0x%02x, %s script, %d bytes\n", nInputs, nOutputs, nHashType,
+           fPubKeyScript ? "pubkey" : "hash", ::GetSerializeSize(txTo, SER_NETWORK));
+    RunBench("CKey::Verify", BenchVerify, txFrom, txTo, vInputs);
+    RunBench("SignatureHash", BenchSignatureHash, txFrom, txTo, vInputs);
+    RunBench("EvalScript", BenchEvalScript, txFrom, txTo, vInputs);
+
+    // 100 rounds of small number ops, one of them on a 5 byte number
+    scriptArith << OP_1;
+    for (int i = 0; i < 100; i++)
+        scriptArith << OP_DUP << OP_1ADD << OP_ADD << OP_3 << OP_MUL << 1000 << OP_MOD
+                    << OP_DUP << OP_0 << 2000 << OP_WITHIN << OP_VERIFY << OP_2DIV << OP_ABS;
+    scriptArith << OP_DROP << CBigNum(0x7fffffffffLL) << OP_1ADD << OP_0NOTEQUAL;
+
+    // 100 levels of IF with all but the innermost branch taken
+    for (int i = 0; i < 100; i++)
+        scriptNestedIf << OP_1 << OP_IF;
+    scriptNestedIf << OP_0 << OP_IF << OP_RETURN << OP_ENDIF;
+    for (int i = 0; i < 100; i++)
+        scriptNestedIf << OP_ENDIF;
+    scriptNestedIf << OP_1;
+
+    RunBench("Script arithmetic", BenchArith, txFrom, txTo, vInputs);
+    RunBench("Script nested IF", BenchNestedIf, txFrom, txTo, vInputs);
+    return 0;
+}
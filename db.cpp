@@ -178,27 +178,335 @@ void DBFlush(bool fShutdown)
 // CTxDB
 //
 
+//
+// ConnectInputs reads the index entry of every outpoint it spends, usually
+// a transaction from a recent block, and then writes it back.  Committed
+// entries are kept in memory up to -dbcache megabytes.  Changes made inside
+// a transaction stay in a layer of the CTxDB that made them, so several
+// updates of one entry cost a single write, and the layer is written to the
+// db in one batch right before the outermost TxnCommit.  Only then do the
+// changes replace what the shared cache has, and TxnAbort just drops the
+// layer.  A layer that outgrows the budget, like in a long reorganize, is
+// written into the still open transaction early.
+//
+
+// Rough size of a map node holding the entry
+static inline int64 GetCacheBytes(const CTxIndex& txindex)
+{
+    return 100 + txindex.vSpent.size() * sizeof(CDiskTxPos);
+}
+
+struct CTxIndexCacheEntry
+{
+    CTxIndex txindex;
+    bool fErased;
+};
+
+class CTxIndexCacheLayer
+{
+public:
+    map<uint256, CTxIndexCacheEntry> mapEntry;
+    set<uint256> setWritten;    // already written into the db transaction
+    int64 nBytes;
+
+    CTxIndexCacheLayer()
+    {
+        nBytes = 0;
+    }
+
+    void Set(const uint256& hash, const CTxIndexCacheEntry& entry)
+    {
+        map<uint256, CTxIndexCacheEntry>::iterator mi = mapEntry.find(hash);
+        if (mi != mapEntry.end())
+        {
+            nBytes -= GetCacheBytes((*mi).second.txindex);
+            (*mi).second = entry;
+        }
+        else
+        {
+            mapEntry.insert(make_pair(hash, entry));
+        }
+        nBytes += GetCacheBytes(entry.txindex);
+    }
+};
+
+class CTxIndexCache
+{
+protected:
+    map<uint256, CTxIndex> mapTxIndex;
+    int64 nBytes;
+    int64 nMaxBytes;
+
+    void EraseEntry(const uint256& hash)
+    {
+        map<uint256, CTxIndex>::iterator mi = mapTxIndex.find(hash);
+        if (mi != mapTxIndex.end())
+        {
+            nBytes -= GetCacheBytes((*mi).second);
+            mapTxIndex.erase(mi);
+        }
+    }
+
+    void SetEntry(const uint256& hash, const CTxIndex& txindex)
+    {
+        EraseEntry(hash);
+        int64 nEntryBytes = GetCacheBytes(txindex);
+        if (nEntryBytes > GetMaxBytes())
+            return;
+        while (nBytes + nEntryBytes > nMaxBytes)
+        {
+            // Evict the entry following a random hash
+            uint256 hashRand;
+            RAND_bytes((unsigned char*)&hashRand, sizeof(hashRand));
+            map<uint256, CTxIndex>::iterator mi = mapTxIndex.lower_bound(hashRand);
+            if (mi == mapTxIndex.end())
+                mi = mapTxIndex.begin();
+            nBytes -= GetCacheBytes((*mi).second);
+            mapTxIndex.erase(mi);
+        }
+        mapTxIndex[hash] = txindex;
+        nBytes += nEntryBytes;
+    }
+
+public:
+    CCriticalSection cs;
+    unsigned int nGeneration;   // changes whenever committed entries do
+
+    CTxIndexCache()
+    {
+        nBytes = 0;
+        nMaxBytes = -1;
+        nGeneration = 0;
+    }
+
+    int64 GetMaxBytes()
+    {
+        if (nMaxBytes < 0)
+        {
+            nMaxBytes = 25;
+            if (mapArgs.count("-dbcache"))
+                nMaxBytes = max(atoi64(mapArgs["-dbcache"]), (int64)0);
+            nMaxBytes <<= 20;
+        }
+        return nMaxBytes;
+    }
+
+    bool Get(const uint256& hash, CTxIndex& txindex, unsigned int& nGenerationRet)
+    {
+        CRITICAL_BLOCK(cs)
+        {
+            nGenerationRet = nGeneration;
+            map<uint256, CTxIndex>::iterator mi = mapTxIndex.find(hash);
+            if (mi == mapTxIndex.end())
+                return false;
+            txindex = (*mi).second;
+            return true;
+        }
+        return false;
+    }
+
+    // Remembers an entry read from the db, unless something was committed since
+    void Add(const uint256& hash, const CTxIndex& txindex, unsigned int nGenerationRead)
+    {
+        CRITICAL_BLOCK(cs)
+            if (nGeneration == nGenerationRead && !mapTxIndex.count(hash))
+                SetEntry(hash, txindex);
+    }
+
+    void Commit(const CTxIndexCacheLayer& layer)
+    {
+        CRITICAL_BLOCK(cs)
+        {
+            nGeneration++;
+            foreach(const uint256& hash, layer.setWritten)
+                EraseEntry(hash);
+            foreach(const PAIRTYPE(uint256, CTxIndexCacheEntry)& item, layer.mapEntry)
+            {
+                if (item.second.fErased)
+                    EraseEntry(item.first);
+                else
+                    SetEntry(item.first, item.second.txindex);
+            }
+        }
+    }
+
+    void Erase(const uint256& hash)
+    {
+        CRITICAL_BLOCK(cs)
+        {
+            nGeneration++;
+            EraseEntry(hash);
+        }
+    }
+};
+
+static CTxIndexCache txindexcache;
+
+
+void CTxDB::Close()
+{
+    foreach(CTxIndexCacheLayer* player, vCacheLayer)
+        delete player;
+    vCacheLayer.clear();
+    CDB::Close();
+}
+
+bool CTxDB::TxnBegin()
+{
+    if (!CDB::TxnBegin())
+        return false;
+    vCacheLayer.push_back(new CTxIndexCacheLayer());
+    return true;
+}
+
+bool CTxDB::TxnCommit()
+{
+    if (vCacheLayer.empty())
+        return CDB::TxnCommit();
+    CTxIndexCacheLayer* player = vCacheLayer.back();
+    vCacheLayer.pop_back();
+
+    bool fRet;
+    if (!vCacheLayer.empty())
+    {
+        // Nested, the changes become part of the enclosing transaction
+        CTxIndexCacheLayer* pouter = vCacheLayer.back();
+        foreach(const uint256& hash, player->setWritten)
+        {
+            map<uint256, CTxIndexCacheEntry>::iterator mi = pouter->mapEntry.find(hash);
+            if (mi != pouter->mapEntry.end())
+            {
+                pouter->nBytes -= GetCacheBytes((*mi).second.txindex);
+                pouter->mapEntry.erase(mi);
+            }
+            pouter->setWritten.insert(hash);
+        }
+        foreach(const PAIRTYPE(uint256, CTxIndexCacheEntry)& item, player->mapEntry)
+            pouter->Set(item.first, item.second);
+        fRet = CDB::TxnCommit();
+    }
+    else
+    {
+        // Outermost, everything goes to the db in one batch
+        if (WriteCacheLayer(player))
+        {
+            fRet = CDB::TxnCommit();
+        }
+        else
+        {
+            CDB::TxnAbort();
+            fRet = false;
+        }
+        if (fRet)
+            txindexcache.Commit(*player);
+    }
+    delete player;
+    return fRet;
+}
+
+bool CTxDB::TxnAbort()
+{
+    if (!vCacheLayer.empty())
+    {
+        delete vCacheLayer.back();
+        vCacheLayer.pop_back();
+    }
+    return CDB::TxnAbort();
+}
+
+bool CTxDB::WriteCacheLayer(CTxIndexCacheLayer* player)
+{
+    foreach(const PAIRTYPE(uint256, CTxIndexCacheEntry)& item, player->mapEntry)
+    {
+        bool fOk;
+        if (item.second.fErased)
+            fOk = Erase(make_pair(string("tx"), item.first));
+        else
+            fOk = Write(make_pair(string("tx"), item.first), item.second.txindex);
+        if (!fOk)
+            return error("CTxDB::WriteCacheLayer() : writing tx index failed");
+    }
+    return true;
+}
+
+bool CTxDB::WriteCachedTxIndex(uint256 hash, const CTxIndex* ptxindex)
+{
+    if (vCacheLayer.empty())
+    {
+        // Not in a transaction, write through like before
+        bool fRet = (ptxindex ? Write(make_pair(string("tx"), hash), *ptxindex) : Erase(make_pair(string("tx"), hash)));
+        txindexcache.Erase(hash);
+        return fRet;
+    }
+
+    CTxIndexCacheLayer* player = vCacheLayer.back();
+    CTxIndexCacheEntry entry;
+    if (ptxindex)
+        entry.txindex = *ptxindex;
+    entry.fErased = (ptxindex == NULL);
+    player->Set(hash, entry);
+
+    if (player->nBytes > txindexcache.GetMaxBytes())
+    {
+        // Too big to hold until the commit, reads of these go to the db now
+        if (!WriteCacheLayer(player))
+            return false;
+        foreach(const PAIRTYPE(uint256, CTxIndexCacheEntry)& item, player->mapEntry)
+            player->setWritten.insert(item.first);
+        player->mapEntry.clear();
+        player->nBytes = 0;
+    }
+    return true;
+}
+
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
     txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
+
+    // Uncommitted changes of this CTxDB come first
+    bool fWritten = false;
+    for (int i = vCacheLayer.size()-1; i >= 0 && !fWritten; i--)
+    {
+        CTxIndexCacheLayer* player = vCacheLayer[i];
+        map<uint256, CTxIndexCacheEntry>::iterator mi = player->mapEntry.find(hash);
+        if (mi != player->mapEntry.end())
+        {
+            if ((*mi).second.fErased)
+                return false;
+            txindex = (*mi).second.txindex;
+            return true;
+        }
+        fWritten = player->setWritten.count(hash);
+    }
+
+    unsigned int nGeneration = 0;
+    if (!fWritten && txindexcache.Get(hash, txindex, nGeneration))
+        return true;
+    if (!Read(make_pair(string("tx"), hash), txindex))
+        return false;
+    if (!fWritten)
+        txindexcache.Add(hash, txindex, nGeneration);
+    return true;
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
     assert(!fClient);
-    return Write(make_pair(string("tx"), hash), txindex);
+    return WriteCachedTxIndex(hash, &txindex);
 }
 
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
 {
     assert(!fClient);
 
-    // Add to tx index
+    // Add to tx index, the coin db keeps track of spending instead of vSpent.
+    // The positions are still needed with the coin db: ContainsTx is how the
+    // wallet and relay code tell a tx is in a block, and disconnecting a
+    // block older than its undo record reads the previous txes through it.
     uint256 hash = tx.GetHash();
-    CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    CTxIndex txindex(pos, fCoinDB ? 0 : tx.vout.size());
+    return WriteCachedTxIndex(hash, &txindex);
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
@@ -206,15 +514,77 @@ bool CTxDB::EraseTxIndex(const CTransaction& tx)
     assert(!fClient);
     uint256 hash = tx.GetHash();
 
-    return Erase(make_pair(string("tx"), hash));
+    return WriteCachedTxIndex(hash, NULL);
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
     assert(!fClient);
+    for (int i = vCacheLayer.size()-1; i >= 0; i--)
+    {
+        CTxIndexCacheLayer* player = vCacheLayer[i];
+        map<uint256, CTxIndexCacheEntry>::iterator mi = player->mapEntry.find(hash);
+        if (mi != player->mapEntry.end())
+            return !(*mi).second.fErased;
+        if (player->setWritten.count(hash))
+            return Exists(make_pair(string("tx"), hash));
+    }
+
+    CTxIndex txindex;
+    unsigned int nGeneration;
+    if (txindexcache.Get(hash, txindex, nGeneration))
+        return true;
     return Exists(make_pair(string("tx"), hash));
 }
 
+bool CTxDB::ReadCoin(const COutPoint& outpoint, CCoin& coin)
+{
+    assert(!fClient);
+    coin.SetNull();
+    return Read(make_pair(string("coin"), outpoint), coin);
+}
+
+bool CTxDB::WriteCoin(const COutPoint& outpoint, const CCoin& coin)
+{
+    assert(!fClient);
+    return Write(make_pair(string("coin"), outpoint), coin);
+}
+
+bool CTxDB::EraseCoin(const COutPoint& outpoint)
+{
+    assert(!fClient);
+    return Erase(make_pair(string("coin"), outpoint));
+}
+
+bool CTxDB::ReadBlockUndo(uint256 hashBlock, CBlockUndo& blockundo)
+{
+    assert(!fClient);
+    blockundo.vtxundo.clear();
+    return Read(make_pair(string("blockundo"), hashBlock), blockundo);
+}
+
+bool CTxDB::WriteBlockUndo(uint256 hashBlock, const CBlockUndo& blockundo)
+{
+    assert(!fClient);
+    return Write(make_pair(string("blockundo"), hashBlock), blockundo);
+}
+
+bool CTxDB::EraseBlockUndo(uint256 hashBlock)
+{
+    assert(!fClient);
+    return Erase(make_pair(string("blockundo"), hashBlock));
+}
+
+bool CTxDB::ReadCoinDB(bool& fCoinDBRet)
+{
+    return Read(string("coindb"), fCoinDBRet);
+}
+
+bool CTxDB::WriteCoinDB(bool fCoinDBIn)
+{
+    return Write(string("coindb"), fCoinDBIn);
+}
+
 bool CTxDB::ReadOwnerTxes(uint160 hash160, int nMinHeight, vector<CTransaction>& vtx)
 {
     assert(!fClient);
@@ -379,6 +749,7 @@ bool CTxDB::LoadBlockIndex()
             pindexNew->nTime          = diskindex.nTime;
             pindexNew->nBits          = diskindex.nBits;
             pindexNew->nNonce         = diskindex.nNonce;
+            mapBlockPos[make_pair(pindexNew->nFile, pindexNew->nBlockPos)] = pindexNew;
 
             // Watch for genesis block and best block
             if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
@@ -8,6 +8,8 @@ class CTxIndex;
 class CDiskBlockIndex;
 class CDiskTxPos;
 class COutPoint;
+class CCoin;
+class CBlockUndo;
 class CUser;
 class CReview;
 class CAddress;
@@ -251,19 +253,40 @@ public:
 
 
 
+class CTxIndexCacheLayer;
+
 class CTxDB : public CDB
 {
 public:
     CTxDB(const char* pszMode="r+", bool fTxn=false) : CDB(!fClient ? "blkindex.dat" : NULL, pszMode, fTxn) { }
+    ~CTxDB() { Close(); }
 private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
+
+    // Tx index changes not written yet, one layer per open transaction
+    vector<CTxIndexCacheLayer*> vCacheLayer;
+
+    bool WriteCachedTxIndex(uint256 hash, const CTxIndex* ptxindex);
+    bool WriteCacheLayer(CTxIndexCacheLayer* player);
 public:
+    void Close();
+    bool TxnBegin();
+    bool TxnCommit();
+    bool TxnAbort();
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
     bool EraseTxIndex(const CTransaction& tx);
     bool ContainsTx(uint256 hash);
+    bool ReadCoin(const COutPoint& outpoint, CCoin& coin);
+    bool WriteCoin(const COutPoint& outpoint, const CCoin& coin);
+    bool EraseCoin(const COutPoint& outpoint);
+    bool ReadCoinDB(bool& fCoinDBRet);
+    bool WriteCoinDB(bool fCoinDBIn);
+    bool ReadBlockUndo(uint256 hashBlock, CBlockUndo& blockundo);
+    bool WriteBlockUndo(uint256 hashBlock, const CBlockUndo& blockundo);
+    bool EraseBlockUndo(uint256 hashBlock);
     bool ReadOwnerTxes(uint160 hash160, int nHeight, vector<CTransaction>& vtx);
     bool ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
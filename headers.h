@@ -68,6 +68,9 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -88,6 +91,8 @@ using namespace boost;
 #include "strlcpy.h"
 #include "serialize.h"
 #include "uint256.h"
+#include "sha256.h"
+#include "secp256k1.h"
 #include "util.h"
 #include "key.h"
 #include "bignum.h"
@@ -97,6 +102,7 @@ using namespace boost;
 #include "net.h"
 #include "irc.h"
 #include "main.h"
+#include "workserver.h"
 #include "market.h"
 #include "uibase.h"
 #include "ui.h"
@@ -45,6 +45,90 @@ typedef vector<unsigned char, secure_allocator<unsigned char> > CPrivKey;
 
 
 
+//
+// Decoded public keys by their serialized form, so checking a signature
+// against a key seen before skips EC_KEY_new_by_curve_name and
+// o2i_ECPublicKey.  The least recently used key is dropped when full.
+// The EC_KEYs are reference counted, so one evicted while a check is
+// still using it lives until that check frees it.
+//
+class CPubKeyCache
+{
+protected:
+    typedef list<vector<unsigned char> > list_type;
+    CCriticalSection cs;
+    list_type listLRU;
+    map<vector<unsigned char>, pair<EC_KEY*, list_type::iterator> > mapKeys;
+    unsigned int nMaxSize;
+
+public:
+    CPubKeyCache()
+    {
+        nMaxSize = 0;
+    }
+
+    ~CPubKeyCache()
+    {
+        for (map<vector<unsigned char>, pair<EC_KEY*, list_type::iterator> >::iterator mi = mapKeys.begin(); mi != mapKeys.end(); ++mi)
+            EC_KEY_free((*mi).second.first);
+    }
+
+    // Returns a reference the caller must EC_KEY_free, or NULL if the key doesn't decode
+    EC_KEY* Get(const vector<unsigned char>& vchPubKey)
+    {
+        CRITICAL_BLOCK(cs)
+        {
+            map<vector<unsigned char>, pair<EC_KEY*, list_type::iterator> >::iterator mi = mapKeys.find(vchPubKey);
+            if (mi != mapKeys.end())
+            {
+                listLRU.splice(listLRU.begin(), listLRU, (*mi).second.second);
+                EC_KEY_up_ref((*mi).second.first);
+                return (*mi).second.first;
+            }
+        }
+
+        // Decode outside the lock
+        if (vchPubKey.empty())
+            return NULL;
+        EC_KEY* pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+        if (pkey == NULL)
+            throw key_error("CPubKeyCache::Get() : EC_KEY_new_by_curve_name failed");
+        const unsigned char* pbegin = &vchPubKey[0];
+        if (!o2i_ECPublicKey(&pkey, &pbegin, vchPubKey.size()))
+        {
+            EC_KEY_free(pkey);
+            return NULL;
+        }
+
+        CRITICAL_BLOCK(cs)
+        {
+            if (nMaxSize == 0)
+            {
+                nMaxSize = 10000;
+                if (mapArgs.count("-maxpubkeycachesize"))
+                    nMaxSize = max(atoi(mapArgs["-maxpubkeycachesize"]), 1);
+            }
+            if (!mapKeys.count(vchPubKey))
+            {
+                while (mapKeys.size() >= nMaxSize)
+                {
+                    EC_KEY_free(mapKeys[listLRU.back()].first);
+                    mapKeys.erase(listLRU.back());
+                    listLRU.pop_back();
+                }
+                listLRU.push_front(vchPubKey);
+                mapKeys[vchPubKey] = make_pair(pkey, listLRU.begin());
+                EC_KEY_up_ref(pkey);
+            }
+        }
+        return pkey;
+    }
+};
+
+extern CPubKeyCache pubkeycache;
+
+
+
 class CKey
 {
 protected:
@@ -182,6 +266,14 @@ public:
     */
     bool Verify(uint256 hash, const vector<unsigned char>& vchSig)
     {
+        if (fSet && !vchSig.empty())
+        {
+            vector<unsigned char> vchPubKey = GetPubKey();
+            int nResult = Secp256k1Verify(&vchPubKey[0], vchPubKey.size(), (unsigned char*)&hash, &vchSig[0], vchSig.size());
+            if (nResult != -1)
+                return (nResult == 1);
+        }
+
         // -1 = error, 0 = bad sig, 1 = good
         if (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) != 1)
             return false;
@@ -206,9 +298,20 @@ public:
     */
     static bool Verify(const vector<unsigned char>& vchPubKey, uint256 hash, const vector<unsigned char>& vchSig)
     {
-        CKey key;
-        if (!key.SetPubKey(vchPubKey))
+        // Native secp256k1 when it can judge the encodings, else OpenSSL
+        if (!vchPubKey.empty() && !vchSig.empty())
+        {
+            int nResult = Secp256k1Verify(&vchPubKey[0], vchPubKey.size(), (unsigned char*)&hash, &vchSig[0], vchSig.size());
+            if (nResult != -1)
+                return (nResult == 1);
+        }
+
+        EC_KEY* pkey = pubkeycache.Get(vchPubKey);
+        if (pkey == NULL)
             return false;
-        return key.Verify(hash, vchSig);
+        // -1 = error, 0 = bad sig, 1 = good
+        bool fValid = (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) == 1);
+        EC_KEY_free(pkey);
+        return fValid;
     }
 };
@@ -19,13 +19,17 @@ map<uint256, CTransaction> mapTransactions;     //@up4dev 交易列表
 CCriticalSection cs_mapTransactions;            //@up4dev 交易的线程隔离区
 unsigned int nTransactionsUpdated = 0;
 map<COutPoint, CInPoint> mapNextTx;
+map<uint256, CPoolFee> mapPoolFee;
+set<pair<int64, uint256> > setPoolByFeeRate;
 
 map<uint256, CBlockIndex*> mapBlockIndex;       //@up4dev 区块索引列表
+map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
 const uint256 hashGenesisBlock("0x000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f");   //@up4dev 创世区块hash
 CBlockIndex* pindexGenesisBlock = NULL;         //@up4dev 创世区块
 int nBestHeight = -1;                           //@up4dev 最长链条高度
 uint256 hashBestChain = 0;                      //
 CBlockIndex* pindexBest = NULL;
+bool fCoinDB = false;
 
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
@@ -459,29 +463,122 @@ bool CTransaction::AcceptTransaction(CTxDB& txdb, bool fCheckInputs, bool* pfMis
             *pfMissingInputs = true;
         return error("AcceptTransaction() : ConnectInputs failed %s", hash.ToString().substr(0,6).c_str());
     }
+    if (!fCheckInputs)
+        nFees = GetPoolTxFee(txdb, *this);
 
     // Store transaction in memory
+    uint256 hashOld = 0;
     CRITICAL_BLOCK(cs_mapTransactions)
     {
         if (ptxOld)
         {
-            printf("mapTransaction.erase(%s) replacing with new version\n", ptxOld->GetHash().ToString().c_str());
-            mapTransactions.erase(ptxOld->GetHash());
+            hashOld = ptxOld->GetHash();
+            printf("mapTransaction.erase(%s) replacing with new version\n", hashOld.ToString().c_str());
+            ptxOld->RemoveFromMemoryPool();
         }
-        AddToMemoryPool();
+        AddToMemoryPool(nFees);
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
     // If updated, erase old tx from wallet
     if (ptxOld)
-        EraseFromWallet(ptxOld->GetHash());
+        EraseFromWallet(hashOld);
 
     printf("AcceptTransaction(): accepted %s\n", hash.ToString().substr(0,6).c_str());
     return true;
 }
 
 
-bool CTransaction::AddToMemoryPool()
+int64 GetPoolTxFee(CTxDB& txdb, const CTransaction& tx)
+{
+    // Fee of a tx whose inputs haven't been checked, 0 if any are missing
+    int64 nValueIn = 0;
+    foreach(const CTxIn& txin, tx.vin)
+    {
+        CTransaction txPrev;
+        CRITICAL_BLOCK(cs_mapTransactions)
+            if (mapTransactions.count(txin.prevout.hash))
+                txPrev = mapTransactions[txin.prevout.hash];
+        if (txPrev.IsNull())
+        {
+            if (fCoinDB)
+            {
+                CCoin coin;
+                if (!txdb.ReadCoin(txin.prevout, coin))
+                    return 0;
+                nValueIn += coin.txout.nValue;
+                continue;
+            }
+            CTxIndex txindex;
+            if (!txdb.ReadTxIndex(txin.prevout.hash, txindex) || !txPrev.ReadFromDisk(txindex.pos))
+                return 0;
+        }
+        if (txin.prevout.n >= txPrev.vout.size())
+            return 0;
+        nValueIn += txPrev.vout[txin.prevout.n].nValue;
+    }
+    int64 nFee = nValueIn - tx.GetValueOut();
+    return (nFee > 0 ? nFee : 0);
+}
+
+void UpdatePoolFeeRate(const uint256& hash)
+{
+    // Caller must hold cs_mapTransactions
+    map<uint256, CPoolFee>::iterator mi = mapPoolFee.find(hash);
+    if (mi == mapPoolFee.end())
+        return;
+    CPoolFee& poolfee = (*mi).second;
+    setPoolByFeeRate.erase(make_pair(poolfee.GetFeePerKB(), hash));
+
+    // Sum over the distinct unconfirmed ancestors
+    poolfee.nFeeWithAncestors = poolfee.nFee;
+    poolfee.nSizeWithAncestors = poolfee.nSize;
+    set<uint256> setAncestors;
+    vector<uint256> vWork(1, hash);
+    while (!vWork.empty())
+    {
+        const CTransaction& tx = mapTransactions[vWork.back()];
+        vWork.pop_back();
+        foreach(const CTxIn& txin, tx.vin)
+        {
+            map<uint256, CPoolFee>::iterator mi2 = mapPoolFee.find(txin.prevout.hash);
+            if (mi2 == mapPoolFee.end() || !setAncestors.insert(txin.prevout.hash).second)
+                continue;
+            poolfee.nFeeWithAncestors += (*mi2).second.nFee;
+            poolfee.nSizeWithAncestors += (*mi2).second.nSize;
+            vWork.push_back(txin.prevout.hash);
+        }
+    }
+
+    setPoolByFeeRate.insert(make_pair(poolfee.GetFeePerKB(), hash));
+}
+
+void UpdatePoolFeeRateDescendants(const uint256& hash, unsigned int nOutputs)
+{
+    // Caller must hold cs_mapTransactions
+    set<uint256> setDone;
+    vector<pair<uint256, unsigned int> > vWork(1, make_pair(hash, nOutputs));
+    while (!vWork.empty())
+    {
+        uint256 hashParent = vWork.back().first;
+        unsigned int nParentOutputs = vWork.back().second;
+        vWork.pop_back();
+        for (unsigned int n = 0; n < nParentOutputs; n++)
+        {
+            map<COutPoint, CInPoint>::iterator mi = mapNextTx.find(COutPoint(hashParent, n));
+            if (mi == mapNextTx.end())
+                continue;
+            CTransaction* ptxChild = (*mi).second.ptx;
+            uint256 hashChild = ptxChild->GetHash();
+            if (!setDone.insert(hashChild).second)
+                continue;
+            UpdatePoolFeeRate(hashChild);
+            vWork.push_back(make_pair(hashChild, ptxChild->vout.size()));
+        }
+    }
+}
+
+bool CTransaction::AddToMemoryPool(int64 nFee)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call AcceptTransaction to properly check the transaction first.
@@ -491,6 +588,13 @@ bool CTransaction::AddToMemoryPool()
         mapTransactions[hash] = *this;
         for (int i = 0; i < vin.size(); i++)
             mapNextTx[vin[i].prevout] = CInPoint(&mapTransactions[hash], i);
+
+        // Index by fee rate
+        CPoolFee& poolfee = mapPoolFee[hash];
+        poolfee.nFee = nFee;
+        poolfee.nSize = ::GetSerializeSize(*this, SER_NETWORK);
+        UpdatePoolFeeRate(hash);
+        UpdatePoolFeeRateDescendants(hash, vout.size());
         nTransactionsUpdated++;
     }
     return true;
@@ -502,9 +606,20 @@ bool CTransaction::RemoveFromMemoryPool()
     // Remove transaction from memory pool
     CRITICAL_BLOCK(cs_mapTransactions)
     {
+        // This may be the copy in mapTransactions, so don't use any members
+        // after erasing it
+        uint256 hash = GetHash();
+        unsigned int nOutputs = vout.size();
         foreach(const CTxIn& txin, vin)
             mapNextTx.erase(txin.prevout);
-        mapTransactions.erase(GetHash());
+        map<uint256, CPoolFee>::iterator mi = mapPoolFee.find(hash);
+        if (mi != mapPoolFee.end())
+        {
+            setPoolByFeeRate.erase(make_pair((*mi).second.GetFeePerKB(), hash));
+            mapPoolFee.erase(mi);
+        }
+        mapTransactions.erase(hash);
+        UpdatePoolFeeRateDescendants(hash, nOutputs);
         nTransactionsUpdated++;
     }
     return true;
@@ -667,6 +782,25 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pblockindex, bool fReadTransactions
     return ReadFromDisk(pblockindex->nFile, pblockindex->nBlockPos, fReadTransactions);
 }
 
+static void MerkleHashPairsChunk(void* parg, int nBegin, int nEnd)
+{
+    pair<uint256*, const uint256*>& args = *(pair<uint256*, const uint256*>*)parg;
+    SHA256D64((unsigned char*)&args.first[nBegin], (const unsigned char*)&args.second[2*nBegin], nEnd - nBegin);
+}
+
+// Hashes nPairs adjacent pairs of pin into pout, one level of a merkle tree.
+// Big levels are split over the ParallelFor threads.
+void MerkleHashPairs(uint256* pout, const uint256* pin, int nPairs)
+{
+    if (nPairs < 1024)
+    {
+        SHA256D64((unsigned char*)pout, (const unsigned char*)pin, nPairs);
+        return;
+    }
+    pair<uint256*, const uint256*> args(pout, pin);
+    ParallelFor(MerkleHashPairsChunk, &args, nPairs, 256);
+}
+
 uint256 GetOrphanRoot(const CBlock* pblock)
 {
     // Work back to the first block in the orphan chain
@@ -773,8 +907,60 @@ unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast)
 
 
 
-bool CTransaction::DisconnectInputs(CTxDB& txdb)
+// The block index of the block a transaction at pos was stored in
+CBlockIndex* GetBlockIndexAtPos(const CDiskTxPos& pos)
+{
+    map<pair<unsigned int, unsigned int>, CBlockIndex*>::iterator mi = mapBlockPos.find(make_pair(pos.nFile, pos.nBlockPos));
+    if (mi == mapBlockPos.end())
+        return NULL;
+    return (*mi).second;
+}
+
+bool CTransaction::DisconnectInputs(CTxDB& txdb, const CTxUndo* ptxundo)
 {
+    if (fCoinDB)
+    {
+        // Put back the outputs this spent and take out the ones it created
+        if (ptxundo && !IsCoinBase())
+        {
+            if (ptxundo->vprevout.size() != vin.size())
+                return error("DisconnectInputs() : undo record doesn't match");
+            for (int i = 0; i < vin.size(); i++)
+                if (!txdb.WriteCoin(vin[i].prevout, ptxundo->vprevout[i]))
+                    return error("DisconnectInputs() : WriteCoin failed");
+        }
+        else if (!IsCoinBase())
+        {
+            // No undo record, find each spent output from its transaction
+            foreach(const CTxIn& txin, vin)
+            {
+                COutPoint prevout = txin.prevout;
+
+                CTransaction txPrev;
+                CTxIndex txindex;
+                if (!txdb.ReadDiskTx(prevout.hash, txPrev, txindex))
+                    return error("DisconnectInputs() : ReadDiskTx failed");
+                if (prevout.n >= txPrev.vout.size())
+                    return error("DisconnectInputs() : prevout.n out of range");
+
+                CBlockIndex* pindexPrev = GetBlockIndexAtPos(txindex.pos);
+                if (!pindexPrev || !pindexPrev->IsInMainChain())
+                    return error("DisconnectInputs() : prev tx not in main chain");
+                if (!txdb.WriteCoin(prevout, CCoin(txPrev.vout[prevout.n], pindexPrev->nHeight, txPrev.IsCoinBase())))
+                    return error("DisconnectInputs() : WriteCoin failed");
+            }
+        }
+
+        uint256 hash = GetHash();
+        for (int i = 0; i < vout.size(); i++)
+            if (!txdb.EraseCoin(COutPoint(hash, i)))
+                return error("DisconnectInputs() : EraseCoin failed");
+
+        if (!txdb.EraseTxIndex(*this))
+            return error("DisconnectInputs() : EraseTxPos failed");
+        return true;
+    }
+
     // Relinquish previous transactions' spent pointers
     if (!IsCoinBase())
     {
@@ -815,7 +1001,7 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
     fMiner          挖矿计算时该变量为true
     nMinFee         实现计算好的最小交易费，用于判断交易费是否合理
 */
-bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx, int nHeight, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee)
+bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx, int nHeight, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee, vector<CScriptCheck>* pvChecks, CTxUndo* ptxundo)
 {
     // Take over previous transactions' spent pointers
     if (!IsCoinBase())
@@ -833,17 +1019,41 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
                 // Get txindex from current proposed changes
                 txindex = mapTestPool[prevout.hash];
             }
-            else
+            else if (!fCoinDB)
             {
                 // Read txindex from txdb
                 fFound = txdb.ReadTxIndex(prevout.hash, txindex);
             }
+            else
+            {
+                fFound = false;
+            }
+
+            // With the coin db the output is read directly, its txindex here
+            // only tracks what this block or test pool has spent
+            CCoin coin;
+            bool fCoin = false;
+            if (fCoinDB && (!fFound || txindex.pos.IsNull()))
+            {
+                fCoin = txdb.ReadCoin(prevout, coin);
+                if (fCoin)
+                {
+                    fFound = true;
+                    if (prevout.n >= txindex.vSpent.size())
+                        txindex.vSpent.resize(prevout.n + 1);
+                }
+            }
             if (!fFound && (fBlock || fMiner))
                 return fMiner ? false : error("ConnectInputs() : %s prev tx %s index entry not found", GetHash().ToString().substr(0,6).c_str(),  prevout.hash.ToString().substr(0,6).c_str());
 
             // Read txPrev
             CTransaction txPrev;
-            if (!fFound || txindex.pos == CDiskTxPos(1,1,1))
+            const CTxOut* ptxoutPrev = NULL;
+            if (fCoin)
+            {
+                ptxoutPrev = &coin.txout;
+            }
+            else if (!fFound || txindex.pos == CDiskTxPos(1,1,1))
             {
                 // Get prev tx from single transactions in memory
                 CRITICAL_BLOCK(cs_mapTransactions)
@@ -862,8 +1072,12 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
                     return error("ConnectInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,6).c_str(),  prevout.hash.ToString().substr(0,6).c_str());
             }
 
-            if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
-                return error("ConnectInputs() : %s prevout.n out of range %d %d %d prev tx %s\n%s", GetHash().ToString().substr(0,6).c_str(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString().substr(0,6).c_str(), txPrev.ToString().c_str());
+            if (!fCoin)
+            {
+                if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
+                    return error("ConnectInputs() : %s prevout.n out of range %d %d %d prev tx %s\n%s", GetHash().ToString().substr(0,6).c_str(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString().substr(0,6).c_str(), txPrev.ToString().c_str());
+                ptxoutPrev = &txPrev.vout[prevout.n];
+            }
 
             /*
                 @up4dev 
@@ -872,14 +1086,26 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
                 必须要大于COINBASE_MATURITY个区块
             */
             // If prev is coinbase, check that it's matured
-            if (txPrev.IsCoinBase())
-                for (CBlockIndex* pindex = pindexBest; pindex && nBestHeight - pindex->nHeight < COINBASE_MATURITY-1; pindex = pindex->pprev)
-                    if (pindex->nBlockPos == txindex.pos.nBlockPos && pindex->nFile == txindex.pos.nFile)
-                        return error("ConnectInputs() : tried to spend coinbase at depth %d", nBestHeight - pindex->nHeight);
+            if (fCoin)
+            {
+                // Measured from the block being connected, which in a
+                // reorganize isn't the one after the current best
+                int nDepth = (fBlock ? nHeight - 1 : nBestHeight) - coin.nHeight;
+                if (coin.fCoinBase && nDepth < COINBASE_MATURITY-1)
+                    return error("ConnectInputs() : tried to spend coinbase at depth %d", nDepth);
+            }
+            else if (txPrev.IsCoinBase())
+            {
+                CBlockIndex* pindex = GetBlockIndexAtPos(txindex.pos);
+                if (pindex && pindex->IsInMainChain() && nBestHeight - pindex->nHeight < COINBASE_MATURITY-1)
+                    return error("ConnectInputs() : tried to spend coinbase at depth %d", nBestHeight - pindex->nHeight);
+            }
 
             // @up4dev 验证签名
             // Verify signature
-            if (!VerifySignature(txPrev, *this, i))
+            if (pvChecks)
+                pvChecks->push_back(CScriptCheck(ptxoutPrev->scriptPubKey, *this, i));
+            else if (!VerifySignature(ptxoutPrev->scriptPubKey, *this, i))
                 return error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,6).c_str());
             
             // @up4dev 已经在txindex.vSpent中出现过，代表该输入已经被用过，出现了冲突
@@ -894,11 +1120,25 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
             // @up4dev 写回这笔支出，接收区块的情况写回磁盘，挖矿的情况写回mapTestPool数据结构
             // Write back
             if (fBlock)
-                txdb.UpdateTxIndex(prevout.hash, txindex);
+            {
+                if (fCoin)
+                {
+                    if (ptxundo)
+                        ptxundo->vprevout.push_back(coin);
+                    if (!txdb.EraseCoin(prevout))
+                        return error("ConnectInputs() : EraseCoin failed");
+                }
+                else
+                {
+                    txdb.UpdateTxIndex(prevout.hash, txindex);
+                }
+            }
             else if (fMiner)
+            {
                 mapTestPool[prevout.hash] = txindex;
+            }
             // @up4dev 计算输入金额
-            nValueIn += txPrev.vout[prevout.n].nValue;
+            nValueIn += ptxoutPrev->nValue;
         }
 
         // @up4dev 总输入 - 总输出 = 交易费
@@ -919,6 +1159,15 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
         // Add transaction to disk index
         if (!txdb.AddTxIndex(*this, posThisTx, nHeight))
             return error("ConnectInputs() : AddTxPos failed");
+
+        // New outputs go into the coin db
+        if (fCoinDB)
+        {
+            uint256 hash = GetHash();
+            for (int i = 0; i < vout.size(); i++)
+                if (!txdb.WriteCoin(COutPoint(hash, i), CCoin(vout[i], nHeight, IsCoinBase())))
+                    return error("ConnectInputs() : WriteCoin failed");
+        }
     }
     else if (fMiner)
     {
@@ -978,9 +1227,20 @@ bool CTransaction::ClientConnectInputs()
 
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
+    // The undo record has the coins to put back, blocks connected without
+    // one fall back to reading the previous transactions
+    CBlockUndo blockundo;
+    bool fUndo = false;
+    if (fCoinDB)
+    {
+        uint256 hashBlock = pindex->GetBlockHash();
+        fUndo = (txdb.ReadBlockUndo(hashBlock, blockundo) && blockundo.vtxundo.size() == vtx.size());
+        txdb.EraseBlockUndo(hashBlock);
+    }
+
     // Disconnect in reverse order
     for (int i = vtx.size()-1; i >= 0; i--)
-        if (!vtx[i].DisconnectInputs(txdb))
+        if (!vtx[i].DisconnectInputs(txdb, fUndo ? &blockundo.vtxundo[i] : NULL))
             return false;
 
     // Update block index on disk without changing it in memory.
@@ -995,25 +1255,103 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
-bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
+struct CScriptCheckBatch
+{
+    const vector<CScriptCheck>* pvChecks;
+    vector<unsigned char> vfValid;
+    volatile bool fFailed;
+};
+
+// A check that throws fails, the same on any thread.  Run serially the
+// exception used to come out of ConnectBlock and reject the block.
+static bool RunScriptCheck(const CScriptCheck& check)
+{
+    try
+    {
+        return check();
+    }
+    catch (std::exception& e)
+    {
+        LogException(&e, "RunScriptCheck()");
+    }
+    catch (...)
+    {
+        LogException(NULL, "RunScriptCheck()");
+    }
+    return false;
+}
+
+static void ScriptChecksChunk(void* parg, int nBegin, int nEnd)
+{
+    CScriptCheckBatch& batch = *(CScriptCheckBatch*)parg;
+    for (int i = nBegin; i < nEnd && !batch.fFailed; i++)
+    {
+        batch.vfValid[i] = RunScriptCheck((*batch.pvChecks)[i]);
+        if (!batch.vfValid[i])
+            batch.fFailed = true;
+    }
+}
+
+bool RunScriptChecks(const vector<CScriptCheck>& vChecks)
+{
+    CScriptCheckBatch batch;
+    batch.pvChecks = &vChecks;
+    batch.vfValid.resize(vChecks.size(), 0);
+    batch.fFailed = false;
+    ParallelFor(ScriptChecksChunk, &batch, vChecks.size(), 4);
+    if (!batch.fFailed)
+        return true;
+
+    // Report the first failure in block order like the serial checks did
+    for (int i = 0; i < vChecks.size(); i++)
+        if (!batch.vfValid[i] && !RunScriptCheck(vChecks[i]))
+            return error("ConnectInputs() : %s VerifySignature failed", vChecks[i].ptxTo->GetHash().ToString().substr(0,6).c_str());
+    return error("RunScriptChecks() : check failed");
+}
+
+bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fWallet)
 {
     //// issue here: it doesn't know the version
     unsigned int nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK) - 1 + GetSizeOfCompactSize(vtx.size());
 
     map<uint256, CTxIndex> mapUnused;
+    vector<CScriptCheck> vChecks;
+    CBlockUndo blockundo;
+    if (fCoinDB)
+        blockundo.vtxundo.resize(vtx.size());
     int64 nFees = 0;
-    foreach(CTransaction& tx, vtx)
+    for (int i = 0; i < vtx.size(); i++)
     {
+        CTransaction& tx = vtx[i];
         CDiskTxPos posThisTx(pindex->nFile, pindex->nBlockPos, nTxPos);
         nTxPos += ::GetSerializeSize(tx, SER_DISK);
 
-        if (!tx.ConnectInputs(txdb, mapUnused, posThisTx, pindex->nHeight, nFees, true, false))
+        if (!tx.ConnectInputs(txdb, mapUnused, posThisTx, pindex->nHeight, nFees, true, false, 0, &vChecks, fCoinDB ? &blockundo.vtxundo[i] : NULL))
             return false;
     }
 
+    // Verify the signatures on all cores, the txdb transaction is
+    // aborted by the caller if any of them fail
+    if (!RunScriptChecks(vChecks))
+        return false;
+
     if (vtx[0].GetValueOut() > GetBlockValue(nFees))
         return false;
 
+    if (fCoinDB)
+    {
+        if (!txdb.WriteBlockUndo(pindex->GetBlockHash(), blockundo))
+            return error("ConnectBlock() : WriteBlockUndo failed");
+
+        // Only the last UNDO_DEPTH blocks keep their undo record, a deeper
+        // reorganize falls back to reading the previous transactions
+        CBlockIndex* pindexOld = pindex;
+        for (int i = 0; i < UNDO_DEPTH && pindexOld; i++)
+            pindexOld = pindexOld->pprev;
+        if (pindexOld)
+            txdb.EraseBlockUndo(pindexOld->GetBlockHash());
+    }
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1024,8 +1362,9 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     }
 
     // Watch for transactions paying to me
-    foreach(CTransaction& tx, vtx)
-        AddToWalletIfMine(tx, this);
+    if (fWallet)
+        foreach(CTransaction& tx, vtx)
+            AddToWalletIfMine(tx, this);
 
     return true;
 }
@@ -1093,6 +1432,7 @@ bool Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
                 pindex->EraseBlockFromDisk();
                 txdb.EraseBlockIndex(pindex->GetBlockHash());
                 mapBlockIndex.erase(pindex->GetBlockHash());
+                mapBlockPos.erase(make_pair(pindex->nFile, pindex->nBlockPos));
                 delete pindex;
             }
             return error("Reorganize() : ConnectBlock failed");
@@ -1143,6 +1483,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return error("AddToBlockIndex() : new CBlockIndex failed");
     map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
+    mapBlockPos[make_pair(nFile, nBlockPos)] = pindexNew;
     map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
@@ -1170,6 +1511,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
                 txdb.TxnAbort();
                 pindexNew->EraseBlockFromDisk();
                 mapBlockIndex.erase(pindexNew->GetBlockHash());
+                mapBlockPos.erase(make_pair(pindexNew->nFile, pindexNew->nBlockPos));
                 delete pindexNew;
                 return error("AddToBlockIndex() : ConnectBlock failed");
             }
@@ -1504,6 +1846,81 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
     return file;
 }
 
+// Read-only mappings of the block files.  The whole file is mapped, and
+// mapped again at its new size when a read needs more than is mapped.  The
+// lock only covers finding or replacing a mapping, readers hold a reference
+// while they unserialize from it so it isn't unmapped under them.
+static CCriticalSection cs_mapBlockFileMap;
+static map<unsigned int, CBlockFileMap*> mapBlockFileMap;
+
+static void UnmapBlockFileMap(CBlockFileMap* pmap)
+{
+#ifndef __WXMSW__
+    munmap(pmap->pbegin, pmap->nSize);
+#endif
+    delete pmap;
+}
+
+CBlockFileMap* MapBlockFile(unsigned int nFile, unsigned int nEnd)
+{
+#ifdef __WXMSW__
+    return NULL;
+#else
+    // Block files go up to 2GB, too much for a 32-bit address space
+    if (sizeof(void*) < 8 || nFile == -1)
+        return NULL;
+
+    CRITICAL_BLOCK(cs_mapBlockFileMap)
+    {
+        map<unsigned int, CBlockFileMap*>::iterator mi = mapBlockFileMap.find(nFile);
+        if (mi != mapBlockFileMap.end() && nEnd <= (*mi).second->nSize)
+        {
+            (*mi).second->nRefCount++;
+            return (*mi).second;
+        }
+
+        // Map it at its current size
+        int fd = open(strprintf("%s/blk%04d.dat", GetDataDir().c_str(), nFile).c_str(), O_RDONLY);
+        if (fd == -1)
+            return NULL;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < nEnd)
+        {
+            close(fd);
+            return NULL;
+        }
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            return NULL;
+
+        // The old mapping goes once its last reader is done with it
+        if (mi != mapBlockFileMap.end())
+        {
+            CBlockFileMap* pmapOld = (*mi).second;
+            mapBlockFileMap.erase(mi);
+            if (--pmapOld->nRefCount == 0)
+                UnmapBlockFileMap(pmapOld);
+        }
+
+        CBlockFileMap* pmap = new CBlockFileMap;
+        pmap->pbegin = (char*)p;
+        pmap->nSize = st.st_size;
+        pmap->nRefCount = 2;  // the map's and the caller's
+        mapBlockFileMap[nFile] = pmap;
+        return pmap;
+    }
+    return NULL;
+#endif
+}
+
+void ReleaseBlockFileMap(CBlockFileMap* pmap)
+{
+    CRITICAL_BLOCK(cs_mapBlockFileMap)
+        if (--pmap->nRefCount == 0)
+            UnmapBlockFileMap(pmap);
+}
+
 static unsigned int nCurrentBlockFile = 1;
 
 FILE* AppendBlockFile(unsigned int& nFileRet)
@@ -1541,6 +1958,22 @@ bool LoadBlockIndex(bool fAllowNew)
     CTxDB txdb("cr");
     if (!txdb.LoadBlockIndex())
         return false;
+
+    // The coin db mode can only be picked when the index is first created,
+    // after that it's whatever the database was built with
+    bool fStoredCoinDB;
+    if (txdb.ReadCoinDB(fStoredCoinDB))
+    {
+        fCoinDB = fStoredCoinDB;
+        if (fCoinDB != (mapArgs.count("-utxo") > 0))
+            printf("LoadBlockIndex() : -utxo ignored, database is using the %s\n", fCoinDB ? "coin db" : "tx index");
+    }
+    else
+    {
+        fCoinDB = (mapBlockIndex.empty() && mapArgs.count("-utxo"));
+        if (mapBlockIndex.empty())
+            txdb.WriteCoinDB(fCoinDB);
+    }
     txdb.Close();
 
     //
@@ -1690,6 +2123,53 @@ void PrintBlockTree()
     }
 }
 
+// Times disconnecting and reconnecting the top 1, 2, 4 ... nMaxDepth blocks
+// of the main chain, the way Reorganize would.  It's all done in a db
+// transaction that's aborted afterwards and the wallet isn't told about the
+// reconnected blocks, so nothing is left changed.
+void BenchReorganize(int nMaxDepth)
+{
+    CRITICAL_BLOCK(cs_main)
+    {
+        printf("Reorganize benchmark, %s\n", fCoinDB ? "coin db" : "tx index");
+        CTxDB txdb;
+        for (int nDepth = 1; nDepth <= nMaxDepth; nDepth *= 2)
+        {
+            vector<CBlockIndex*> vDisconnect;
+            for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev && vDisconnect.size() < nDepth; pindex = pindex->pprev)
+                vDisconnect.push_back(pindex);
+            if (vDisconnect.size() < nDepth)
+                break;
+
+            txdb.TxnBegin();
+            int64 nStart = GetTimeMillis();
+            bool fOk = true;
+            for (int i = 0; i < vDisconnect.size() && fOk; i++)
+            {
+                CBlock block;
+                fOk = (block.ReadFromDisk(vDisconnect[i], true) && block.DisconnectBlock(txdb, vDisconnect[i]));
+            }
+            int64 nDisconnectTime = GetTimeMillis() - nStart;
+
+            nStart = GetTimeMillis();
+            for (int i = vDisconnect.size()-1; i >= 0 && fOk; i--)
+            {
+                CBlock block;
+                fOk = (block.ReadFromDisk(vDisconnect[i], true) && block.ConnectBlock(txdb, vDisconnect[i], false));
+            }
+            int64 nConnectTime = GetTimeMillis() - nStart;
+            txdb.TxnAbort();
+
+            if (!fOk)
+            {
+                printf("BenchReorganize() : failed at depth %d\n", nDepth);
+                break;
+            }
+            printf("depth %6d   disconnect %8"PRI64d"ms   connect %8"PRI64d"ms\n", nDepth, nDisconnectTime, nConnectTime);
+        }
+    }
+}
+
 
 
 
@@ -2374,29 +2854,244 @@ int FormatHashBlocks(void* pbuffer, unsigned int len)
 using CryptoPP::ByteReverse;
 static int detectlittleendian = 1;
 
-void BlockSHA256(const void* pin, unsigned int nBlocks, void* pout)
+void BlockSHA256(const void* pin, unsigned int nBlocks, void* pout, const unsigned int* pmidstate=NULL)
 {
-    unsigned int* pinput = (unsigned int*)pin;
     unsigned int* pstate = (unsigned int*)pout;
 
-    CryptoPP::SHA256::InitState(pstate);
+    // Start from the state left by the blocks before pin if the caller has it
+    if (pmidstate)
+        memcpy(pstate, pmidstate, 8 * sizeof(unsigned int));
+    else
+        CryptoPP::SHA256::InitState(pstate);
+
+    SHA256Transform(pstate, pin, nBlocks);
 
     if (*(char*)&detectlittleendian != 0)
+        for (int i = 0; i < 8; i++)
+            pstate[i] = ByteReverse(pstate[i]);
+}
+
+void CBlockTemplate::Reset(CBlockIndex* pindexPrevIn, const vector<unsigned char>& vchPubKey)
+{
+    pindexPrev = pindexPrevIn;
+    block.SetNull();
+    vtxHash.clear();
+    mapTestPool.clear();
+    setTried.clear();
+    nFees = 0;
+    nBlockSize = 0;
+
+    //@up4dev 构造挖矿交易(coinbase)，该交易包含挖到的比特币，可以用key来解锁消费
+    //
+    // Create coinbase tx, the extranonce is filled in by GetMinerWork
+    //
+    CTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vout.resize(1);
+    txNew.vout[0].scriptPubKey << vchPubKey << OP_CHECKSIG;
+
+    //@up4dev 将挖矿(coinbase)交易加入区块作为第一个交易
+    // Add our coinbase tx as first transaction
+    block.vtx.push_back(txNew);
+    vtxHash.push_back(0);
+
+    block.hashPrevBlock = (pindexPrev ? pindexPrev->GetBlockHash() : 0);
+    //@up4dev 获取下一区块的挖矿难度
+    block.nBits = GetNextWorkRequired(pindexPrev);
+    // @up4dev 计算本区块的挖矿奖励
+    block.vtx[0].vout[0].nValue = block.GetBlockValue(nFees);
+}
+
+bool CBlockTemplate::HasMissingTransactions() const
+{
+    // Caller must hold cs_mapTransactions
+    for (int i = 1; i < vtxHash.size(); i++)
+        if (!mapTransactions.count(vtxHash[i]))
+            return true;
+    return false;
+}
+
+bool CBlockTemplate::AddTransaction(CTxDB& txdb, CTransaction& tx, const uint256& hash)
+{
+    if (tx.IsCoinBase() || !tx.IsFinal())
+        return false;
+
+    // Save the mapTestPool entries ConnectInputs may write, which are the
+    // prev txes and this tx, so a failure can be undone without copying
+    // the whole map
+    map<uint256, CTxIndex> mapUndo;
+    set<uint256> setNew;
+    foreach(const CTxIn& txin, tx.vin)
+    {
+        map<uint256, CTxIndex>::iterator mi = mapTestPool.find(txin.prevout.hash);
+        if (mi != mapTestPool.end())
+            mapUndo.insert(*mi);
+        else
+            setNew.insert(txin.prevout.hash);
+    }
+    if (!mapTestPool.count(hash))
+        setNew.insert(hash);
+
+    // @up4dev 获取交易费(最少需要多少)，小于10k的前100个交易是免费的，费率是0.01/kb
+    // Transaction fee requirements, mainly only needed for flood control
+    // Under 10K (about 80 inputs) is free for first 100 transactions
+    // Base rate is 0.01 per KB
+    int64 nMinFee = tx.GetMinFee(block.vtx.size() < 100);
+
+    int64 nFeesTmp = nFees;
+    if (!tx.ConnectInputs(txdb, mapTestPool, CDiskTxPos(1,1,1), 0, nFeesTmp, false, true, nMinFee))
+    {
+        foreach(const uint256& hashNew, setNew)
+            mapTestPool.erase(hashNew);
+        for (map<uint256, CTxIndex>::iterator mi = mapUndo.begin(); mi != mapUndo.end(); ++mi)
+            mapTestPool[(*mi).first] = (*mi).second;
+        return false;
+    }
+
+    nFees = nFeesTmp;
+    block.vtx.push_back(tx);
+    vtxHash.push_back(hash);
+    nBlockSize += ::GetSerializeSize(tx, SER_NETWORK);
+    block.vtx[0].vout[0].nValue = block.GetBlockValue(nFees);
+    block.vtx[0].InvalidateHash();
+    return true;
+}
+
+int CBlockTemplate::AddWithParents(CTxDB& txdb, const uint256& hash)
+{
+    // Each memory pool tx is tried once per template, after any parents
+    // that are also in the memory pool.  The walk uses its own stack since
+    // a chain of memory pool txes can be as long as anyone cares to make it.
+    // The flag is set once a tx's parents have been pushed.
+    int nAdded = 0;
+    vector<pair<uint256, bool> > vStack;
+    vStack.push_back(make_pair(hash, false));
+    while (!vStack.empty())
     {
-        for (int n = 0; n < nBlocks; n++)
+        uint256 hashTx = vStack.back().first;
+        bool fParentsDone = vStack.back().second;
+        vStack.pop_back();
+
+        map<uint256, CTransaction>::iterator mi = mapTransactions.find(hashTx);
+        if (mi == mapTransactions.end())
+            continue;
+        CTransaction& tx = (*mi).second;
+
+        if (fParentsDone)
         {
-            unsigned int pbuf[16];
-            for (int i = 0; i < 16; i++)
-                pbuf[i] = ByteReverse(pinput[n * 16 + i]);
-            CryptoPP::SHA256::Transform(pstate, pbuf);
+            if (nBlockSize < MAX_SIZE/2 && AddTransaction(txdb, tx, hashTx))
+                nAdded++;
+            continue;
         }
-        for (int i = 0; i < 8; i++)
-            pstate[i] = ByteReverse(pstate[i]);
+
+        if (setTried.count(hashTx))
+            continue;
+        setTried.insert(hashTx);
+
+        // Parents are pushed last to first so they come off in vin order
+        vStack.push_back(make_pair(hashTx, true));
+        for (int i = tx.vin.size()-1; i >= 0; i--)
+            if (!setTried.count(tx.vin[i].prevout.hash))
+                vStack.push_back(make_pair(tx.vin[i].prevout.hash, false));
     }
-    else
+    return nAdded;
+}
+
+int CBlockTemplate::AddFromMemoryPool(CTxDB& txdb)
+{
+    // Caller must hold cs_main and cs_mapTransactions
+    // Best paying packages first until the block is full
+    int nAdded = 0;
+    for (set<pair<int64, uint256> >::reverse_iterator it = setPoolByFeeRate.rbegin(); it != setPoolByFeeRate.rend() && nBlockSize < MAX_SIZE/2; ++it)
+        nAdded += AddWithParents(txdb, (*it).second);
+    return nAdded;
+}
+
+//
+// The miner threads share one block template.  Whichever thread finds it
+// out of date brings it up to date, the others just take a copy.  Every
+// copy gets the next value of the shared extranonce in its coinbase, so each
+// thread hashes its own merkle root and can scan the whole nonce range
+// without overlapping the others.
+//
+static CCriticalSection cs_BitcoinMiner;
+static CBlockTemplate minertemplate;
+static vector<uint256> vMinerMerkleBranch;
+static unsigned int nMinerTemplateTransactionsUpdated = 0;
+static CKey keyMiner;
+static bool fMinerKey = false;
+static CBigNum bnMinerExtraNonce = 0;
+
+void IncrementMinerExtraNonce(CBlock& block, const vector<uint256>& vMerkleBranch)
+{
+    // Give the block the next extranonce.  The coinbase is on the left edge
+    // of the merkle tree, so given the branch next to that edge only the
+    // hashes up the edge need to be redone.
+    CRITICAL_BLOCK(cs_BitcoinMiner)
+        block.vtx[0].vin[0].scriptSig = CScript() << block.nBits << ++bnMinerExtraNonce;
+    block.vtx[0].InvalidateHash();
+    block.vMerkleTree.clear();
+    block.hashMerkleRoot = CBlock::CheckMerkleBranch(block.vtx[0].GetHash(), vMerkleBranch, 0);
+}
+
+bool GetMinerWork(CBlock& block, CBlockIndex*& pindexPrev, unsigned int& nTransactionsUpdatedLast, CKey& key, vector<uint256>& vMerkleBranch)
+{
+    CRITICAL_BLOCK(cs_BitcoinMiner)
     {
-        for (int n = 0; n < nBlocks; n++)
-            CryptoPP::SHA256::Transform(pstate, pinput + n * 16);
+        if (minertemplate.pindexPrev != pindexBest || nTransactionsUpdated != nMinerTemplateTransactionsUpdated)
+        {
+            if (!fMinerKey)
+            {
+                keyMiner.MakeNewKey();
+                fMinerKey = true;
+            }
+
+            //@up4dev 收集最近的交易并加入区块
+            // Collect the latest transactions into the block.  Start over if
+            // the best chain moved, our key has been used or a tx in the
+            // template left the memory pool, otherwise just add the new ones.
+            CRITICAL_BLOCK(cs_main)
+            CRITICAL_BLOCK(cs_mapTransactions)
+            {
+                nMinerTemplateTransactionsUpdated = nTransactionsUpdated;
+                if (minertemplate.pindexPrev != pindexBest || minertemplate.HasMissingTransactions())
+                    minertemplate.Reset(pindexBest, keyMiner.GetPubKey());
+                CTxDB txdb("r");
+                if (minertemplate.AddFromMemoryPool(txdb) > 0)
+                    printf("BitcoinMiner: template updated, %d transactions\n", minertemplate.block.vtx.size());
+            }
+
+            // The coinbase's merkle branch doesn't depend on the coinbase
+            minertemplate.block.BuildMerkleTree();
+            vMinerMerkleBranch = minertemplate.block.GetMerkleBranch(0);
+            minertemplate.block.vMerkleTree.clear();
+        }
+
+        block = minertemplate.block;
+        pindexPrev = minertemplate.pindexPrev;
+        nTransactionsUpdatedLast = nMinerTemplateTransactionsUpdated;
+        key = keyMiner;
+        vMerkleBranch = vMinerMerkleBranch;
+
+        // Give this copy its own extranonce
+        IncrementMinerExtraNonce(block, vMerkleBranch);
+    }
+    return true;
+}
+
+void RotateMinerKey(const CKey& key)
+{
+    // A block paying to key has been found, later templates must pay to a
+    // new key.  Copies of the old template still in flight are harmless:
+    // they'll find pindexBest has moved before they could be accepted.
+    CRITICAL_BLOCK(cs_BitcoinMiner)
+    {
+        if (fMinerKey && keyMiner.GetPubKey() == key.GetPubKey())
+        {
+            keyMiner.MakeNewKey();
+            minertemplate.pindexPrev = NULL;
+        }
     }
 }
 
@@ -2406,12 +3101,8 @@ void BlockSHA256(const void* pin, unsigned int nBlocks, void* pout)
 */
 void BitcoinMiner()
 {
-    printf("BitcoinMiner started\n");
+    printf("BitcoinMiner started, using %s SHA-256\n", ScanHashName());
 
-    //@up4dev 挖矿交易中挖到的比特币的交易密钥，该密钥会在每次挖到区块后更新
-    CKey key;
-    key.MakeNewKey();
-    CBigNum bnExtraNonce = 0;
     //@up4dev 直到参数fGenerateBitcoins被置为False，该循环都会持续运转来尝试挖取新的区块
     while (fGenerateBitcoins)
     {
@@ -2431,80 +3122,20 @@ void BitcoinMiner()
                 return;
         }
 
-        unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
-        //@up4dev 切换至最佳(长)链
-        CBlockIndex* pindexPrev = pindexBest;
-        //@up4dev 获取下一区块的挖矿难度
-        unsigned int nBits = GetNextWorkRequired(pindexPrev);
-
-
-        //@up4dev 构造挖矿交易(coinbase)，该交易包含挖到的比特币，可以用key来解锁消费
-        //
-        // Create coinbase tx
-        //
-        CTransaction txNew;
-        txNew.vin.resize(1);
-        txNew.vin[0].prevout.SetNull();
-        txNew.vin[0].scriptSig << nBits << ++bnExtraNonce;
-        txNew.vout.resize(1);
-        txNew.vout[0].scriptPubKey << key.GetPubKey() << OP_CHECKSIG;
-
-
-        //@up4dev 创建新区快
+        //@up4dev 从共享的区块模板取得一份带有独立extranonce的拷贝
         //
-        // Create new block
+        // Get a copy of the shared template with our own extranonce
         //
         auto_ptr<CBlock> pblock(new CBlock());
         if (!pblock.get())
             return;
-        //@up4dev 将挖矿(coinbase)交易加入区块作为第一个交易
-        // Add our coinbase tx as first transaction
-        pblock->vtx.push_back(txNew);
-
-        //@up4dev 收集最近的交易并加入区块
-        // Collect the latest transactions into the block
-        int64 nFees = 0;
-        CRITICAL_BLOCK(cs_main)
-        CRITICAL_BLOCK(cs_mapTransactions)
-        {
-            CTxDB txdb("r");
-            map<uint256, CTxIndex> mapTestPool;
-            vector<char> vfAlreadyAdded(mapTransactions.size());
-            bool fFoundSomething = true;
-            unsigned int nBlockSize = 0;
-            while (fFoundSomething && nBlockSize < MAX_SIZE/2)
-            {
-                fFoundSomething = false;
-                unsigned int n = 0;
-                for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi, ++n)
-                {
-                    if (vfAlreadyAdded[n])
-                        continue;
-                    CTransaction& tx = (*mi).second;
-                    if (tx.IsCoinBase() || !tx.IsFinal())
-                        continue;
-
-                    // @up4dev 获取交易费(最少需要多少)，小于10k的前100个交易是免费的，费率是0.01/kb
-                    // Transaction fee requirements, mainly only needed for flood control
-                    // Under 10K (about 80 inputs) is free for first 100 transactions
-                    // Base rate is 0.01 per KB
-                    int64 nMinFee = tx.GetMinFee(pblock->vtx.size() < 100);
-
-                    map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-                    if (!tx.ConnectInputs(txdb, mapTestPoolTmp, CDiskTxPos(1,1,1), 0, nFees, false, true, nMinFee))
-                        continue;
-                    swap(mapTestPool, mapTestPoolTmp);
-
-                    pblock->vtx.push_back(tx);
-                    nBlockSize += ::GetSerializeSize(tx, SER_NETWORK);
-                    vfAlreadyAdded[n] = true;
-                    fFoundSomething = true;
-                }
-            }
-        }
-        pblock->nBits = nBits;
-        // @up4dev 计算本区块的挖矿奖励
-        pblock->vtx[0].vout[0].nValue = pblock->GetBlockValue(nFees);
+        CBlockIndex* pindexPrev;
+        unsigned int nTransactionsUpdatedLast;
+        CKey key;
+        vector<uint256> vMerkleBranch;
+        if (!GetMinerWork(*pblock, pindexPrev, nTransactionsUpdatedLast, key, vMerkleBranch))
+            continue;
+        unsigned int nBits = pblock->nBits;
         printf("Running BitcoinMiner with %d transactions in block\n", pblock->vtx.size());
 
 
@@ -2531,7 +3162,7 @@ void BitcoinMiner()
 
         tmp.block.nVersion       = pblock->nVersion;
         tmp.block.hashPrevBlock  = pblock->hashPrevBlock  = (pindexPrev ? pindexPrev->GetBlockHash() : 0);
-        tmp.block.hashMerkleRoot = pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        tmp.block.hashMerkleRoot = pblock->hashMerkleRoot;
         tmp.block.nTime          = pblock->nTime          = max((pindexPrev ? pindexPrev->GetMedianTimePast()+1 : 0), GetAdjustedTime());
         tmp.block.nBits          = pblock->nBits          = nBits;
         tmp.block.nNonce         = pblock->nNonce         = 1;
@@ -2539,6 +3170,14 @@ void BitcoinMiner()
         unsigned int nBlocks0 = FormatHashBlocks(&tmp.block, sizeof(tmp.block));
         unsigned int nBlocks1 = FormatHashBlocks(&tmp.hash1, sizeof(tmp.hash1));
 
+        // The first 64 bytes of the header end inside hashMerkleRoot, before
+        // nTime and nNonce, so they only need to be hashed once per block.
+        // Each nonce then costs the remaining transforms.
+        unsigned int pmidstate[8];
+        CryptoPP::SHA256::InitState(pmidstate);
+        SHA256Transform(pmidstate, &tmp.block, 1);
+        char* pblockrest = (char*)&tmp.block + 64;
+
 
         //
         // Search
@@ -2548,11 +3187,15 @@ void BitcoinMiner()
         uint256 hash;
         loop
         {
-            BlockSHA256(&tmp.block, nBlocks0, &tmp.hash1);
-            BlockSHA256(&tmp.hash1, nBlocks1, &hash);
-
-            if (hash <= hashTarget)
+            // Scan the nonces up to the next multiple of 0x10000 in one batch
+            unsigned int nCount = 0x10000 - (tmp.block.nNonce & 0xffff);
+            unsigned int nNonceFound;
+            if (ScanHash(pmidstate, pblockrest, (unsigned int*)BEGIN(hashTarget), tmp.block.nNonce, nCount, nNonceFound))
             {
+                tmp.block.nNonce = nNonceFound;
+                BlockSHA256(pblockrest, nBlocks0 - 1, &tmp.hash1, pmidstate);
+                BlockSHA256(&tmp.hash1, nBlocks1, &hash);
+                assert(hash <= hashTarget);
                 pblock->nNonce = tmp.block.nNonce;
                 assert(hash == pblock->GetHash());
 
@@ -2562,6 +3205,7 @@ void BitcoinMiner()
                     pblock->print();
 
                 SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_NORMAL);
+                RotateMinerKey(key);
                 CRITICAL_BLOCK(cs_main)
                 {
                     if (pindexPrev == pindexBest)
@@ -2569,7 +3213,6 @@ void BitcoinMiner()
                         // Save key
                         if (!AddKey(key))
                             return;
-                        key.MakeNewKey();
 
                         // Process this block the same as if we had received it from another node
                         if (!ProcessBlock(NULL, pblock.release()))
@@ -2583,24 +3226,28 @@ void BitcoinMiner()
             }
 
             // Update nTime every few seconds
-            if ((++tmp.block.nNonce & 0xffff) == 0)
+            tmp.block.nNonce += nCount;
+            if (fShutdown)
+                return;
+            if (!fGenerateBitcoins)
+                return;
+            if (fLimitProcessors && vnThreadsRunning[3] > nLimitProcessors)
+                return;
+            if (pindexPrev != pindexBest)
+                break;
+            if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
+                break;
+            if (vNodes.empty())
+                break;
+            if (tmp.block.nNonce == 0)
             {
-                if (fShutdown)
-                    return;
-                if (!fGenerateBitcoins)
-                    return;
-                if (fLimitProcessors && vnThreadsRunning[3] > nLimitProcessors)
-                    return;
-                if (tmp.block.nNonce == 0)
-                    break;
-                if (pindexPrev != pindexBest)
-                    break;
-                if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
-                    break;
-                if (vNodes.empty())
-                    break;
-                tmp.block.nTime = pblock->nTime = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
+                // Nonce space used up, carry on with a new extranonce
+                IncrementMinerExtraNonce(*pblock, vMerkleBranch);
+                tmp.block.hashMerkleRoot = pblock->hashMerkleRoot;
+                CryptoPP::SHA256::InitState(pmidstate);
+                SHA256Transform(pmidstate, &tmp.block, 1);
             }
+            tmp.block.nTime = pblock->nTime = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
         }
     }
 }
@@ -2768,6 +3415,7 @@ bool CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, CK
             {
                 wtxNew.vin.clear();
                 wtxNew.vout.clear();
+                wtxNew.InvalidateHash();
                 if (nValue < 0)
                     return false;
                 int64 nValueOut = nValue;
@@ -13,11 +13,21 @@ class CBlock;
 class CBlockIndex;
 class CWalletTx;
 class CKeyItem;
+class CScriptCheck;
+class CTxUndo;
+
+struct CBlockFileMap
+{
+    char* pbegin;
+    unsigned int nSize;
+    int nRefCount;
+};
 
 static const unsigned int MAX_SIZE = 0x02000000;
 static const int64 COIN = 100000000;
 static const int64 CENT = 1000000;
 static const int COINBASE_MATURITY = 100;
+static const int UNDO_DEPTH = 2016;
 
 static const CBigNum bnProofOfWorkLimit(~uint256(0) >> 32);
 
@@ -28,11 +38,13 @@ static const CBigNum bnProofOfWorkLimit(~uint256(0) >> 32);
 
 extern CCriticalSection cs_main;
 extern map<uint256, CBlockIndex*> mapBlockIndex;
+extern map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
 extern const uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nBestHeight;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
+extern bool fCoinDB;
 extern unsigned int nTransactionsUpdated;
 
 // Settings
@@ -51,13 +63,21 @@ extern int nLimitProcessors;
 bool CheckDiskSpace(int64 nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
+CBlockFileMap* MapBlockFile(unsigned int nFile, unsigned int nEnd);
+void ReleaseBlockFileMap(CBlockFileMap* pmap);
 bool AddKey(const CKey& key);
 vector<unsigned char> GenerateNewKey();
 bool AddToWallet(const CWalletTx& wtxIn);
 void ReacceptWalletTransactions();
 void RelayWalletTransactions();
+int64 GetPoolTxFee(CTxDB& txdb, const CTransaction& tx);
 bool LoadBlockIndex(bool fAllowNew=true);
+bool ProcessBlock(CNode* pfrom, CBlock* pblock);
+void MerkleHashPairs(uint256* pout, const uint256* pin, int nPairs);
+bool RunScriptChecks(const vector<CScriptCheck>& vChecks);
+CBlockIndex* GetBlockIndexAtPos(const CDiskTxPos& pos);
 void PrintBlockTree();
+void BenchReorganize(int nMaxDepth);
 bool ProcessMessages(CNode* pfrom);
 bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv);
 bool SendMessages(CNode* pto);
@@ -67,8 +87,45 @@ bool CommitTransactionSpent(const CWalletTx& wtxNew, const CKey& key);
 bool SendMoney(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew);
 void GenerateBitcoins(bool fGenerate);
 void ThreadBitcoinMiner(void* parg);
+bool GetMinerWork(CBlock& block, CBlockIndex*& pindexPrev, unsigned int& nTransactionsUpdatedLast, CKey& key, vector<uint256>& vMerkleBranch);
+void IncrementMinerExtraNonce(CBlock& block, const vector<uint256>& vMerkleBranch);
+void RotateMinerKey(const CKey& key);
 void BitcoinMiner();
 
+// Unserializes obj straight out of the mapped block file.  Returns false if
+// the file can't be mapped or obj doesn't decode, then the caller reads it
+// with stdio instead.  If obj runs past the end of the mapping the file has
+// probably grown since, so it's mapped again at least that far and retried.
+template<typename T>
+bool ReadFromMappedBlockFile(unsigned int nFile, unsigned int nPos, T& obj, int nType=SER_DISK)
+{
+    unsigned int nEnd = nPos + 1;
+    for (int nTry = 0; nTry < 2; nTry++)
+    {
+        CBlockFileMap* pmap = MapBlockFile(nFile, nEnd);
+        if (!pmap)
+            return false;
+        CMemoryReader reader(pmap->pbegin + nPos, pmap->pbegin + pmap->nSize, nType);
+        bool fRead = false;
+        try
+        {
+            reader >> obj;
+            fRead = true;
+        }
+        catch (std::exception& e)
+        {
+        }
+        unsigned int nSize = pmap->nSize;
+        ReleaseBlockFileMap(pmap);
+        if (fRead)
+            return true;
+        if (reader.nShortBy == 0)
+            return false;
+        nEnd = nSize + reader.nShortBy;
+    }
+    return false;
+}
+
 
 
 
@@ -369,6 +426,10 @@ public:
     vector<CTxOut> vout;
     unsigned int nLockTime;
 
+    // memory only
+    mutable uint256 hashCached;
+    mutable vector<unsigned char> vchOutputsCached;
+
 
     CTransaction()
     {
@@ -377,6 +438,11 @@ public:
 
     IMPLEMENT_SERIALIZE
     (
+        if (fRead)
+        {
+            hashCached = 0;
+            vchOutputsCached.clear();
+        }
         READWRITE(this->nVersion);
         nVersion = this->nVersion;
         READWRITE(vin);
@@ -390,6 +456,8 @@ public:
         vin.clear();
         vout.clear();
         nLockTime = 0;
+        hashCached = 0;
+        vchOutputsCached.clear();
     }
 
     bool IsNull() const
@@ -399,7 +467,31 @@ public:
 
     uint256 GetHash() const
     {
-        return SerializeHash(*this);
+        // Computed on first use and kept, including through copies.  Code
+        // that changes vin, vout or nLockTime after the hash may have been
+        // taken must call InvalidateHash().
+        if (hashCached == 0)
+            hashCached = SerializeHash(*this);
+        return hashCached;
+    }
+
+    void InvalidateHash()
+    {
+        hashCached = 0;
+        vchOutputsCached.clear();
+    }
+
+    // vout as serialized for hashing, kept for SignatureHash to reuse
+    // across the inputs of a SIGHASH_ALL transaction
+    const vector<unsigned char>& GetSerializedOutputs() const
+    {
+        if (vchOutputsCached.empty())
+        {
+            CDataStream ss(SER_GETHASH);
+            ss << vout;
+            vchOutputsCached.assign(ss.begin(), ss.end());
+        }
+        return vchOutputsCached;
     }
 
     bool IsFinal(int64 nBlockTime=0) const
@@ -552,6 +644,9 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        if (!pfileRet && ReadFromMappedBlockFile(pos.nFile, pos.nTxPos, *this))
+            return true;
+
         CAutoFile filein = OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb");
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -609,8 +704,8 @@ public:
 
 
 
-    bool DisconnectInputs(CTxDB& txdb);
-    bool ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx, int nHeight, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee=0);
+    bool DisconnectInputs(CTxDB& txdb, const CTxUndo* ptxundo=NULL);
+    bool ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx, int nHeight, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee=0, vector<CScriptCheck>* pvChecks=NULL, CTxUndo* ptxundo=NULL);
     bool ClientConnectInputs();
 
     bool AcceptTransaction(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -622,13 +717,40 @@ public:
     }
 
 protected:
-    bool AddToMemoryPool();
+    bool AddToMemoryPool(int64 nFee);
 public:
     bool RemoveFromMemoryPool();
 };
 
 
 
+//
+// A signature check ConnectInputs has put off, so that ConnectBlock can
+// run all the checks of a block on several threads once the spends have
+// been recorded
+//
+class CScriptCheck
+{
+public:
+    CScript scriptPubKey;
+    const CTransaction* ptxTo;
+    unsigned int nIn;
+
+    CScriptCheck(const CScript& scriptPubKeyIn, const CTransaction& txToIn, unsigned int nInIn) : scriptPubKey(scriptPubKeyIn), ptxTo(&txToIn), nIn(nInIn)
+    {
+        // Fill in the caches now, the checks share nothing once running
+        ptxTo->GetHash();
+        ptxTo->GetSerializedOutputs();
+    }
+
+    bool operator()() const
+    {
+        return VerifySignature(scriptPubKey, *ptxTo, nIn);
+    }
+};
+
+
+
 
 
 //
@@ -841,6 +963,84 @@ public:
 
 
 
+//
+// A coin db record, kept for each unspent output when fCoinDB is set.  It
+// has everything ConnectInputs needs to spend the output, so no block file
+// read is needed, and it's erased once the output is spent.  The txindex
+// then only keeps the position of each transaction.
+//
+class CCoin
+{
+public:
+    CTxOut txout;
+    int nHeight;
+    bool fCoinBase;
+
+    CCoin()
+    {
+        SetNull();
+    }
+
+    CCoin(const CTxOut& txoutIn, int nHeightIn, bool fCoinBaseIn)
+    {
+        txout = txoutIn;
+        nHeight = nHeightIn;
+        fCoinBase = fCoinBaseIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(txout);
+        READWRITE(nHeight);
+        READWRITE(fCoinBase);
+    )
+
+    void SetNull()
+    {
+        txout.SetNull();
+        nHeight = -1;
+        fCoinBase = false;
+    }
+
+    bool IsNull()
+    {
+        return txout.IsNull();
+    }
+};
+
+
+
+//
+// Undo records, the coins a block's transactions spent in the order their
+// inputs spent them.  ConnectBlock writes one per block when fCoinDB is set
+// so DisconnectBlock can put the coins back without looking for each
+// previous transaction.
+//
+class CTxUndo
+{
+public:
+    vector<CCoin> vprevout;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vprevout);
+    )
+};
+
+class CBlockUndo
+{
+public:
+    vector<CTxUndo> vtxundo;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vtxundo);
+    )
+};
+
+
+
+
 
 //
 // Nodes collect new transactions into a block, hash them into a hash tree,
@@ -943,15 +1143,17 @@ public:
         vMerkleTree.clear();
         foreach(const CTransaction& tx, vtx)
             vMerkleTree.push_back(tx.GetHash());
+        // Each level's pairs sit next to each other in vMerkleTree, so a whole
+        // level is hashed in one batch, an odd one out is paired with itself
         int j = 0;
         for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
         {
-            for (int i = 0; i < nSize; i += 2)
-            {
-                int i2 = min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-            }
+            int nPairs = nSize / 2;
+            vMerkleTree.resize(j + nSize + (nSize + 1) / 2);
+            MerkleHashPairs(&vMerkleTree[j+nSize], &vMerkleTree[j], nPairs);
+            if (nSize & 1)
+                vMerkleTree[j+nSize+nPairs] = Hash(BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]),
+                                                   BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]));
             j += nSize;
         }
         return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
@@ -1023,15 +1225,18 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = OpenBlockFile(nFile, nBlockPos, "rb");
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
-        // Read block
-        filein >> *this;
+        if (!ReadFromMappedBlockFile(nFile, nBlockPos, *this, SER_DISK | (fReadTransactions ? 0 : SER_BLOCKHEADERONLY)))
+        {
+            // Open history file to read
+            CAutoFile filein = OpenBlockFile(nFile, nBlockPos, "rb");
+            if (!filein)
+                return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+            if (!fReadTransactions)
+                filein.nType |= SER_BLOCKHEADERONLY;
+
+            // Read block
+            filein >> *this;
+        }
 
         // Check the header
         if (CBigNum().SetCompact(nBits) > bnProofOfWorkLimit)
@@ -1067,7 +1272,7 @@ public:
 
     int64 GetBlockValue(int64 nFees) const;
     bool DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex);
-    bool ConnectBlock(CTxDB& txdb, CBlockIndex* pindex);
+    bool ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fWallet=true);
     bool ReadFromDisk(const CBlockIndex* blockindex, bool fReadTransactions);
     bool AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos);
     bool CheckBlock() const;
@@ -1390,11 +1595,79 @@ public:
 
 
 
+//
+// Fee of a memory pool transaction, and the fee and size of the package it
+// makes together with its unconfirmed ancestors, which all have to go into
+// a block along with it.  setPoolByFeeRate orders the pool by the package
+// fee per kilobyte so the miner can take the best paying transactions first.
+//
+class CPoolFee
+{
+public:
+    int64 nFee;
+    unsigned int nSize;
+    int64 nFeeWithAncestors;
+    unsigned int nSizeWithAncestors;
+
+    CPoolFee()
+    {
+        nFee = 0;
+        nSize = 0;
+        nFeeWithAncestors = 0;
+        nSizeWithAncestors = 0;
+    }
+
+    int64 GetFeePerKB() const
+    {
+        if (nSizeWithAncestors == 0)
+            return 0;
+        return nFeeWithAncestors * 1000 / nSizeWithAncestors;
+    }
+};
+
+
+
+
+//
+// The miner's block template under construction.  Transactions are tried in
+// order of package fee rate, parents first, on top of the mapTestPool left
+// by the ones already in it.
+// A transaction that fails only has the few entries it touched put back, so
+// transactions that arrive later can be added without starting over.
+//
+class CBlockTemplate
+{
+public:
+    CBlockIndex* pindexPrev;
+    CBlock block;
+    vector<uint256> vtxHash;
+    map<uint256, CTxIndex> mapTestPool;
+    set<uint256> setTried;
+    int64 nFees;
+    unsigned int nBlockSize;
+
+    CBlockTemplate()
+    {
+        pindexPrev = NULL;
+        nFees = 0;
+        nBlockSize = 0;
+    }
+
+    void Reset(CBlockIndex* pindexPrevIn, const vector<unsigned char>& vchPubKey);
+    bool HasMissingTransactions() const;
+    int AddFromMemoryPool(CTxDB& txdb);
+    bool AddTransaction(CTxDB& txdb, CTransaction& tx, const uint256& hash);
+
+protected:
+    int AddWithParents(CTxDB& txdb, const uint256& hash);
+};
 
 
 
 
 extern map<uint256, CTransaction> mapTransactions;
+extern map<uint256, CPoolFee> mapPoolFee;
+extern set<pair<int64, uint256> > setPoolByFeeRate;
 extern map<uint256, CWalletTx> mapWallet;
 extern vector<uint256> vWalletUpdated;
 extern CCriticalSection cs_mapWallet;
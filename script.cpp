@@ -20,7 +20,81 @@ static const CBigNum bnTrue(1);
 
 bool CastToBool(const valtype& vch)
 {
-    return (CBigNum(vch) != bnZero);
+    // Any nonzero magnitude byte is true, only negative zero needs CBigNum
+    for (int i = 0; i < vch.size(); i++)
+    {
+        if (vch[i] != 0)
+        {
+            if (i == vch.size()-1 && vch[i] == 0x80)
+                return (CBigNum(vch) != bnZero);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+//
+// Numbers on the stack are little-endian sign and magnitude, the way
+// CBigNum::getvch() writes them.  Nearly all of them are small, so values
+// of up to 4 bytes in their shortest encoding are done as int64 and
+// anything else still goes through CBigNum.  Every int64 result of two
+// such operands fits, and SetSmallNum writes the same bytes getvch() would.
+//
+static inline bool GetSmallNum(const valtype& vch, int64& nRet)
+{
+    unsigned int nSize = vch.size();
+    if (nSize == 0)
+    {
+        nRet = 0;
+        return true;
+    }
+    if (nSize > 4)
+        return false;
+
+    // No padding bytes and no negative zero
+    if ((vch[nSize-1] & 0x7f) == 0 && (nSize == 1 || !(vch[nSize-2] & 0x80)))
+        return false;
+
+    int64 n = 0;
+    for (unsigned int i = 0; i < nSize; i++)
+        n |= (int64)vch[i] << (8 * i);
+    if (vch[nSize-1] & 0x80)
+        n = -(n & ~((int64)0x80 << (8 * (nSize-1))));
+    nRet = n;
+    return true;
+}
+
+static inline void SetSmallNum(valtype& vch, int64 n)
+{
+    vch.clear();
+    if (n == 0)
+        return;
+    bool fNegative = (n < 0);
+    uint64 nAbs = (fNegative ? -(uint64)n : (uint64)n);
+    while (nAbs)
+    {
+        vch.push_back(nAbs & 0xff);
+        nAbs >>= 8;
+    }
+    if (vch.back() & 0x80)
+        vch.push_back(fNegative ? 0x80 : 0);
+    else if (fNegative)
+        vch.back() |= 0x80;
+}
+
+static inline void PushSmallNum(vector<valtype>& stack, int64 n)
+{
+    stack.push_back(vchFalse);
+    SetSmallNum(stack.back(), n);
+}
+
+int CastToInt(const valtype& vch)
+{
+    int64 n;
+    if (GetSmallNum(vch, n))
+        return (int)n;
+    return CBigNum(vch).getint();
 }
 
 /*
@@ -53,28 +127,31 @@ void MakeSameSize(valtype& vch1, valtype& vch2)
 bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType,
                 vector<vector<unsigned char> >* pvStackRet)
 {
-    CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
     vector<bool> vfExec;
+    int nExecFalse = 0;     // number of false entries in vfExec
     vector<valtype> stack;
     vector<valtype> altstack;
     if (pvStackRet)
         pvStackRet->clear();
 
+    CDecodedScript decoded(script);
+    vector<CScriptOp>::const_iterator pop = decoded.vOp.begin();
 
     while (pc < pend)
     {
-        bool fExec = !count(vfExec.begin(), vfExec.end(), false);
+        bool fExec = (nExecFalse == 0);
 
         //
         // Read instruction
         //
-        opcodetype opcode;
-        valtype vchPushValue;
-        if (!script.GetOp(pc, opcode, vchPushValue))
+        if (pop == decoded.vOp.end())
             return false;
+        const CScriptOp& op = *pop++;
+        opcodetype opcode = op.opcode;
+        pc = op.pend;
 
         /*
             @up4dev
@@ -85,7 +162,10 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
             IF判断为true时的ELSE代码段里的代码是被跳过不执行的
         */
         if (fExec && opcode <= OP_PUSHDATA4)
-            stack.push_back(vchPushValue);
+        {
+            stack.push_back(vchFalse);
+            stack.back().assign(op.pbegin, op.pend);
+        }
         else if (fExec || (OP_IF <= opcode && opcode <= OP_ENDIF))
         switch (opcode)
         {
@@ -116,8 +196,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                     转换为对应的真实数字，并作为CBigNum入栈
                 */
                 // ( -- value)
-                CBigNum bn((int)opcode - (int)(OP_1 - 1));
-                stack.push_back(bn.getvch());
+                PushSmallNum(stack, (int)opcode - (int)(OP_1 - 1));
             }
             break;
 
@@ -131,8 +210,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
             case OP_VER:
             {
                 //@up4dev 将版本号入栈
-                CBigNum bn(VERSION);
-                stack.push_back(bn.getvch());
+                PushSmallNum(stack, VERSION);
             }
             break;
             case OP_IF:
@@ -153,8 +231,9 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                     if (stack.size() < 1)
                         return false;
                     valtype& vch = stacktop(-1);
+                    int64 n;
                     if (opcode == OP_VERIF || opcode == OP_VERNOTIF)
-                        fValue = (CBigNum(VERSION) >= CBigNum(vch));
+                        fValue = (GetSmallNum(vch, n) ? VERSION >= n : CBigNum(VERSION) >= CBigNum(vch));
                     else
                         fValue = CastToBool(vch);
                     //@up4dev not类的操作，对结果取反
@@ -163,6 +242,8 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                     stack.pop_back();
                 }
                 vfExec.push_back(fValue);
+                if (!fValue)
+                    nExecFalse++;
             }
             break;
 
@@ -176,6 +257,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 if (vfExec.empty())
                     return false;
                 vfExec.back() = !vfExec.back();
+                nExecFalse += (vfExec.back() ? -1 : 1);
             }
             break;
 
@@ -187,6 +269,8 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 */
                 if (vfExec.empty())
                     return false;
+                if (!vfExec.back())
+                    nExecFalse--;
                 vfExec.pop_back();
             }
             break;
@@ -331,8 +415,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
             {
                 //@up4dev 将栈的高度数值压入栈顶
                 // -- stacksize
-                CBigNum bn(stack.size());
-                stack.push_back(bn.getvch());
+                PushSmallNum(stack, stack.size());
             }
             break;
 
@@ -386,7 +469,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                 if (stack.size() < 2)
                     return false;
-                int n = CBigNum(stacktop(-1)).getint();
+                int n = CastToInt(stacktop(-1));
                 stack.pop_back();
                 if (n < 0 || n >= stack.size())
                     return false;
@@ -477,8 +560,8 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 if (stack.size() < 3)
                     return false;
                 valtype& vch = stacktop(-3);
-                int nBegin = CBigNum(stacktop(-2)).getint();
-                int nEnd = nBegin + CBigNum(stacktop(-1)).getint();
+                int nBegin = CastToInt(stacktop(-2));
+                int nEnd = nBegin + CastToInt(stacktop(-1));
                 if (nBegin < 0 || nEnd < nBegin)
                     return false;
                 if (nBegin > vch.size())
@@ -524,7 +607,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 if (stack.size() < 2)
                     return false;
                 valtype& vch = stacktop(-2);
-                int nSize = CBigNum(stacktop(-1)).getint();
+                int nSize = CastToInt(stacktop(-1));
                 if (nSize < 0)
                     return false;
                 if (nSize > vch.size())
@@ -543,8 +626,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (in -- in size)
                 if (stack.size() < 1)
                     return false;
-                CBigNum bn(stacktop(-1).size());
-                stack.push_back(bn.getvch());
+                PushSmallNum(stack, stacktop(-1).size());
             }
             break;
 
@@ -655,20 +737,40 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (in -- out)
                 if (stack.size() < 1)
                     return false;
-                CBigNum bn(stacktop(-1));
-                switch (opcode)
+                int64 n;
+                if (GetSmallNum(stacktop(-1), n))
                 {
-                case OP_1ADD:       bn += bnOne; break;
-                case OP_1SUB:       bn -= bnOne; break;
-                case OP_2MUL:       bn <<= 1; break;
-                case OP_2DIV:       bn >>= 1; break;
-                case OP_NEGATE:     bn = -bn; break;
-                case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                case OP_NOT:        bn = (bn == bnZero); break;
-                case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    // Halving is on the magnitude like BN_rshift
+                    switch (opcode)
+                    {
+                    case OP_1ADD:       n += 1; break;
+                    case OP_1SUB:       n -= 1; break;
+                    case OP_2MUL:       n *= 2; break;
+                    case OP_2DIV:       n = (n < 0 ? -(-n >> 1) : n >> 1); break;
+                    case OP_NEGATE:     n = -n; break;
+                    case OP_ABS:        if (n < 0) n = -n; break;
+                    case OP_NOT:        n = (n == 0); break;
+                    case OP_0NOTEQUAL:  n = (n != 0); break;
+                    }
+                    SetSmallNum(stacktop(-1), n);
+                }
+                else
+                {
+                    CBigNum bn(stacktop(-1));
+                    switch (opcode)
+                    {
+                    case OP_1ADD:       bn += bnOne; break;
+                    case OP_1SUB:       bn -= bnOne; break;
+                    case OP_2MUL:       bn <<= 1; break;
+                    case OP_2DIV:       bn >>= 1; break;
+                    case OP_NEGATE:     bn = -bn; break;
+                    case OP_ABS:        if (bn < bnZero) bn = -bn; break;
+                    case OP_NOT:        bn = (bn == bnZero); break;
+                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    }
+                    stack.pop_back();
+                    stack.push_back(bn.getvch());
                 }
-                stack.pop_back();
-                stack.push_back(bn.getvch());
             }
             break;
 
@@ -716,61 +818,134 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (x1 x2 -- out)
                 if (stack.size() < 2)
                     return false;
-                CBigNum bn1(stacktop(-2));
-                CBigNum bn2(stacktop(-1));
-                CBigNum bn;
-                switch (opcode)
+                int64 n1, n2;
+                if (GetSmallNum(stacktop(-2), n1) && GetSmallNum(stacktop(-1), n2) &&
+                    (opcode != OP_LSHIFT || n2 < 32))
                 {
-                case OP_ADD:
-                    bn = bn1 + bn2;
-                    break;
-
-                case OP_SUB:
-                    bn = bn1 - bn2;
-                    break;
-
-                case OP_MUL:
-                    if (!BN_mul(&bn, &bn1, &bn2, pctx))
-                        return false;
-                    break;
+                    // Division truncates and shifts are on the magnitude,
+                    // the same as BN_div and BN_rshift
+                    int64 n = 0;
+                    switch (opcode)
+                    {
+                    case OP_ADD:
+                        n = n1 + n2;
+                        break;
+
+                    case OP_SUB:
+                        n = n1 - n2;
+                        break;
+
+                    case OP_MUL:
+                        n = n1 * n2;
+                        break;
+
+                    case OP_DIV:
+                        if (n2 == 0)
+                            return false;
+                        n = n1 / n2;
+                        break;
+
+                    case OP_MOD:
+                        if (n2 == 0)
+                            return false;
+                        n = n1 % n2;
+                        break;
+
+                    case OP_LSHIFT:
+                        if (n2 < 0)
+                            return false;
+                        n = (n1 < 0 ? -(-n1 << n2) : n1 << n2);
+                        break;
+
+                    case OP_RSHIFT:
+                        if (n2 < 0)
+                            return false;
+                        n2 = min(n2, (int64)63);
+                        n = (n1 < 0 ? -(-n1 >> n2) : n1 >> n2);
+                        break;
+
+                    case OP_BOOLAND:             n = (n1 != 0 && n2 != 0); break;
+                    case OP_BOOLOR:              n = (n1 != 0 || n2 != 0); break;
+                    case OP_NUMEQUAL:            n = (n1 == n2); break;
+                    case OP_NUMEQUALVERIFY:      n = (n1 == n2); break;
+                    case OP_NUMNOTEQUAL:         n = (n1 != n2); break;
+                    case OP_LESSTHAN:            n = (n1 < n2); break;
+                    case OP_GREATERTHAN:         n = (n1 > n2); break;
+                    case OP_LESSTHANOREQUAL:     n = (n1 <= n2); break;
+                    case OP_GREATERTHANOREQUAL:  n = (n1 >= n2); break;
+                    case OP_MIN:                 n = (n1 < n2 ? n1 : n2); break;
+                    case OP_MAX:                 n = (n1 > n2 ? n1 : n2); break;
+                    }
+                    stack.pop_back();
+                    SetSmallNum(stacktop(-1), n);
+                }
+                else
+                {
+                    CBigNum bn1(stacktop(-2));
+                    CBigNum bn2(stacktop(-1));
+                    CBigNum bn;
+                    switch (opcode)
+                    {
+                    case OP_ADD:
+                        bn = bn1 + bn2;
+                        break;
 
-                case OP_DIV:
-                    if (!BN_div(&bn, NULL, &bn1, &bn2, pctx))
-                        return false;
-                    break;
+                    case OP_SUB:
+                        bn = bn1 - bn2;
+                        break;
 
-                case OP_MOD:
-                    if (!BN_mod(&bn, &bn1, &bn2, pctx))
-                        return false;
-                    break;
+                    case OP_MUL:
+                    {
+                        CAutoBN_CTX pctx;
+                        if (!BN_mul(&bn, &bn1, &bn2, pctx))
+                            return false;
+                        break;
+                    }
 
-                case OP_LSHIFT:
-                    if (bn2 < bnZero)
-                        return false;
-                    bn = bn1 << bn2.getulong();
-                    break;
+                    case OP_DIV:
+                    {
+                        CAutoBN_CTX pctx;
+                        if (!BN_div(&bn, NULL, &bn1, &bn2, pctx))
+                            return false;
+                        break;
+                    }
 
-                case OP_RSHIFT:
-                    if (bn2 < bnZero)
-                        return false;
-                    bn = bn1 >> bn2.getulong();
-                    break;
+                    case OP_MOD:
+                    {
+                        CAutoBN_CTX pctx;
+                        if (!BN_mod(&bn, &bn1, &bn2, pctx))
+                            return false;
+                        break;
+                    }
 
-                case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
-                case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
-                case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
-                case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
-                case OP_LESSTHAN:            bn = (bn1 < bn2); break;
-                case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
-                case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
-                case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
-                case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
-                case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
+                    case OP_LSHIFT:
+                        if (bn2 < bnZero)
+                            return false;
+                        bn = bn1 << bn2.getulong();
+                        break;
+
+                    case OP_RSHIFT:
+                        if (bn2 < bnZero)
+                            return false;
+                        bn = bn1 >> bn2.getulong();
+                        break;
+
+                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
+                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
+                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
+                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
+                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
+                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
+                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
+                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
+                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
+                    case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
+                    case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
+                    }
+                    stack.pop_back();
+                    stack.pop_back();
+                    stack.push_back(bn.getvch());
                 }
-                stack.pop_back();
-                stack.pop_back();
-                stack.push_back(bn.getvch());
 
                 if (opcode == OP_NUMEQUALVERIFY)
                 {
@@ -793,10 +968,19 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 // (x min max -- out)
                 if (stack.size() < 3)
                     return false;
-                CBigNum bn1(stacktop(-3));
-                CBigNum bn2(stacktop(-2));
-                CBigNum bn3(stacktop(-1));
-                bool fValue = (bn2 <= bn1 && bn1 < bn3);
+                int64 n1, n2, n3;
+                bool fValue;
+                if (GetSmallNum(stacktop(-3), n1) && GetSmallNum(stacktop(-2), n2) && GetSmallNum(stacktop(-1), n3))
+                {
+                    fValue = (n2 <= n1 && n1 < n3);
+                }
+                else
+                {
+                    CBigNum bn1(stacktop(-3));
+                    CBigNum bn2(stacktop(-2));
+                    CBigNum bn3(stacktop(-1));
+                    fValue = (bn2 <= bn1 && bn1 < bn3);
+                }
                 stack.pop_back();
                 stack.pop_back();
                 stack.pop_back();
@@ -828,7 +1012,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 else if (opcode == OP_SHA1)
                     SHA1(&vch[0], vch.size(), &vchHash[0]);
                 else if (opcode == OP_SHA256)
-                    SHA256(&vch[0], vch.size(), &vchHash[0]);
+                    CSHA256().Write(&vch[0], vch.size()).Finalize(&vchHash[0]);
                 else if (opcode == OP_HASH160)
                 {
                     uint160 hash160 = Hash160(vch);
@@ -900,7 +1084,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 if (stack.size() < i)
                     return false;
 
-                int nKeysCount = CBigNum(stacktop(-i)).getint();
+                int nKeysCount = CastToInt(stacktop(-i));
                 if (nKeysCount < 0)
                     return false;
                 int ikey = ++i;
@@ -908,7 +1092,7 @@ bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nI
                 if (stack.size() < i)
                     return false;
 
-                int nSigsCount = CBigNum(stacktop(-i)).getint();
+                int nSigsCount = CastToInt(stacktop(-i));
                 if (nSigsCount < 0 || nSigsCount > nKeysCount)
                     return false;
                 int isig = ++i;
@@ -989,69 +1173,159 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
         printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
         return 1;
     }
-    CTransaction txTmp(txTo);
 
     // In case concatenating two scripts ends up with two codeseparators,
     // or an extra one at the end, this prevents all those possible incompatibilities.
     scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
 
-    // Blank out other inputs' signatures
-    for (int i = 0; i < txTmp.vin.size(); i++)
-        txTmp.vin[i].scriptSig = CScript();
-    txTmp.vin[nIn].scriptSig = scriptCode;
+    bool fAnyoneCanPay = (nHashType & SIGHASH_ANYONECANPAY);
+    bool fHashNone = ((nHashType & 0x1f) == SIGHASH_NONE);
+    bool fHashSingle = ((nHashType & 0x1f) == SIGHASH_SINGLE);
+    if (fHashSingle && nIn >= txTo.vout.size())
+    {
+        printf("ERROR: SignatureHash() : nOut=%d out of range\n", nIn);
+        return 1;
+    }
+
+    // Serialize the transaction straight into the hash as it would look
+    // after blanking, rather than copying and editing it for every input
+    CHashWriter ss(SER_GETHASH);
+    ss << txTo.nVersion;
+
+    // Blank out other inputs' signatures, or the other inputs completely
+    // with anyone-can-pay, not recommended for open transactions
+    unsigned int nInputs = (fAnyoneCanPay ? 1 : txTo.vin.size());
+    WriteCompactSize(ss, nInputs);
+    for (unsigned int i = 0; i < nInputs; i++)
+    {
+        unsigned int nInput = (fAnyoneCanPay ? nIn : i);
+        const CTxIn& txin = txTo.vin[nInput];
+        ss << txin.prevout;
+        if (nInput == nIn)
+            ss << scriptCode;
+        else
+            ss << CScript();
+
+        // With a wildcard or single payee let the others update at will
+        if (nInput != nIn && (fHashNone || fHashSingle))
+            ss << (unsigned int)0;
+        else
+            ss << txin.nSequence;
+    }
 
     // Blank out some of the outputs
-    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    if (fHashNone)
     {
         // Wildcard payee
-        txTmp.vout.clear();
-
-        // Let the others update at will
-        for (int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+        WriteCompactSize(ss, 0);
     }
-    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+    else if (fHashSingle)
     {
         // Only lockin the txout payee at same index as txin
-        unsigned int nOut = nIn;
-        if (nOut >= txTmp.vout.size())
+        CTxOut txoutNull;
+        WriteCompactSize(ss, nIn+1);
+        for (unsigned int i = 0; i < nIn; i++)
+            ss << txoutNull;
+        ss << txTo.vout[nIn];
+    }
+    else
+    {
+        const vector<unsigned char>& vchOutputs = txTo.GetSerializedOutputs();
+        ss.write((const char*)&vchOutputs[0], vchOutputs.size());
+    }
+
+    ss << txTo.nLockTime << nHashType;
+    return ss.GetHash();
+}
+
+
+//
+// Remembers signatures that have already been verified, so a transaction
+// checked when it entered the memory pool doesn't pay for ECDSA again when
+// it shows up in a block.  Entries are the hash of (sighash, pubkey, sig) and
+// only successful checks are stored.  When full, a random entry is evicted.
+//
+class CSignatureCache
+{
+protected:
+    CCriticalSection cs;
+    set<uint256> setValid;
+    int nMaxSize;
+    int64 nHits;
+    int64 nMisses;
+
+    int GetMaxSize()
+    {
+        if (nMaxSize < 0)
         {
-            printf("ERROR: SignatureHash() : nOut=%d out of range\n", nOut);
-            return 1;
+            // Each entry costs around 80 bytes with the set node, 0 turns the cache off
+            nMaxSize = 50000;
+            if (mapArgs.count("-maxsigcachesize"))
+                nMaxSize = max(atoi(mapArgs["-maxsigcachesize"]), 0);
         }
-        txTmp.vout.resize(nOut+1);
-        for (int i = 0; i < nOut; i++)
-            txTmp.vout[i].SetNull();
-
-        // Let the others update at will
-        for (int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+        return nMaxSize;
     }
 
-    // Blank out other inputs completely, not recommended for open transactions
-    if (nHashType & SIGHASH_ANYONECANPAY)
+public:
+    CSignatureCache()
     {
-        txTmp.vin[0] = txTmp.vin[nIn];
-        txTmp.vin.resize(1);
+        nMaxSize = -1;
+        nHits = 0;
+        nMisses = 0;
     }
 
-    // Serialize and hash
-    CDataStream ss(SER_GETHASH);
-    ss.reserve(10000);
-    ss << txTmp << nHashType;
-    return Hash(ss.begin(), ss.end());
-}
+    static uint256 GetEntry(const uint256& hash, const vector<unsigned char>& vchPubKey, const vector<unsigned char>& vchSig)
+    {
+        return Hash(BEGIN(hash), END(hash), vchPubKey.begin(), vchPubKey.end(), vchSig.begin(), vchSig.end());
+    }
+
+    bool Get(const uint256& entry)
+    {
+        CRITICAL_BLOCK(cs)
+        {
+            if (GetMaxSize() == 0)
+                return false;
+            bool fFound = setValid.count(entry);
+            if (fFound)
+                nHits++;
+            else
+                nMisses++;
+            if (fDebug && (nHits + nMisses) % 10000 == 0)
+                printf("CSignatureCache: %d entries, %"PRI64d" hits, %"PRI64d" misses\n", setValid.size(), nHits, nMisses);
+            return fFound;
+        }
+        return false;
+    }
+
+    void Set(const uint256& entry)
+    {
+        CRITICAL_BLOCK(cs)
+        {
+            if (GetMaxSize() == 0)
+                return;
+            while (setValid.size() >= nMaxSize)
+            {
+                // Evict the entry following a random hash
+                uint256 hashRand;
+                RAND_bytes((unsigned char*)&hashRand, sizeof(hashRand));
+                set<uint256>::iterator it = setValid.lower_bound(hashRand);
+                if (it == setValid.end())
+                    it = setValid.begin();
+                setValid.erase(it);
+            }
+            setValid.insert(entry);
+        }
+    }
+};
+
+static CSignatureCache sigcache;
+
+CPubKeyCache pubkeycache;
 
 
 bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
-        return false;
-
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
         return false;
@@ -1061,9 +1335,17 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
         return false;
     vchSig.pop_back();
 
-    if (key.Verify(SignatureHash(scriptCode, txTo, nIn, nHashType), vchSig))
+    uint256 hash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 entry = CSignatureCache::GetEntry(hash, vchPubKey, vchSig);
+    if (sigcache.Get(entry))
         return true;
 
+    if (CKey::Verify(vchPubKey, hash, vchSig))
+    {
+        sigcache.Set(entry);
+        return true;
+    }
+
     return false;
 }
 
@@ -1077,61 +1359,68 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
 
 
 
-bool Solver(const CScript& scriptPubKey, vector<pair<opcodetype, valtype> >& vSolutionRet)
+// Templates, built before main() so the verification threads never race
+// to fill them in.  The decoded ones point into the scripts above them.
+
+// Standard tx, sender provides pubkey, receiver adds signature
+static const CScript scriptTemplatePubKey = CScript() << OP_PUBKEY << OP_CHECKSIG;
+
+// Short account number tx, sender provides hash of pubkey, receiver provides signature and pubkey
+static const CScript scriptTemplatePubKeyHash = CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG;
+
+static const CDecodedScript vDecodedTemplates[] =
 {
-    // Templates
-    static vector<CScript> vTemplates;
-    if (vTemplates.empty())
-    {
-        // Standard tx, sender provides pubkey, receiver adds signature
-        vTemplates.push_back(CScript() << OP_PUBKEY << OP_CHECKSIG);
+    CDecodedScript(scriptTemplatePubKey),
+    CDecodedScript(scriptTemplatePubKeyHash),
+};
 
-        // Short account number tx, sender provides hash of pubkey, receiver provides signature and pubkey
-        vTemplates.push_back(CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG);
-    }
+bool Solver(const CScript& scriptPubKey, vector<pair<opcodetype, valtype> >& vSolutionRet)
+{
+    return Solver(CDecodedScript(scriptPubKey), vSolutionRet);
+}
 
-    // Scan templates
-    const CScript& script1 = scriptPubKey;
-    foreach(const CScript& script2, vTemplates)
+bool Solver(const CDecodedScript& scriptPubKey, vector<pair<opcodetype, valtype> >& vSolutionRet)
+{
+    // Scan templates.  A bad opcode ends the script here the same as the
+    // end does, so only the ops before it have to match.
+    const vector<CScriptOp>& vOp1 = scriptPubKey.vOp;
+    for (int nTemplate = 0; nTemplate < ARRAYLEN(vDecodedTemplates); nTemplate++)
     {
+        const CDecodedScript& script2 = vDecodedTemplates[nTemplate];
         vSolutionRet.clear();
-        opcodetype opcode1, opcode2;
-        vector<unsigned char> vch1, vch2;
+        const vector<CScriptOp>& vOp2 = script2.vOp;
+        if (vOp1.size() != vOp2.size())
+            continue;
 
         // Compare
-        CScript::const_iterator pc1 = script1.begin();
-        CScript::const_iterator pc2 = script2.begin();
-        loop
+        int i;
+        for (i = 0; i < vOp1.size(); i++)
         {
-            bool f1 = script1.GetOp(pc1, opcode1, vch1);
-            bool f2 = script2.GetOp(pc2, opcode2, vch2);
-            if (!f1 && !f2)
-            {
-                // Success
-                reverse(vSolutionRet.begin(), vSolutionRet.end());
-                return true;
-            }
-            else if (f1 != f2)
-            {
-                break;
-            }
-            else if (opcode2 == OP_PUBKEY)
+            const CScriptOp& op1 = vOp1[i];
+            opcodetype opcode2 = vOp2[i].opcode;
+            if (opcode2 == OP_PUBKEY)
             {
-                if (vch1.size() <= sizeof(uint256))
+                if (op1.size() <= sizeof(uint256))
                     break;
-                vSolutionRet.push_back(make_pair(opcode2, vch1));
+                vSolutionRet.push_back(make_pair(opcode2, op1.GetData()));
             }
             else if (opcode2 == OP_PUBKEYHASH)
             {
-                if (vch1.size() != sizeof(uint160))
+                if (op1.size() != sizeof(uint160))
                     break;
-                vSolutionRet.push_back(make_pair(opcode2, vch1));
+                vSolutionRet.push_back(make_pair(opcode2, op1.GetData()));
             }
-            else if (opcode1 != opcode2)
+            else if (op1.opcode != opcode2)
             {
                 break;
             }
         }
+        if (i == vOp1.size())
+        {
+            // Success
+            reverse(vSolutionRet.begin(), vSolutionRet.end());
+            return true;
+        }
     }
 
     vSolutionRet.clear();
@@ -1269,6 +1558,7 @@ bool SignSignature(const CTransaction& txFrom, CTransaction& txTo, unsigned int
         return false;
 
     txin.scriptSig = scriptPrereq + txin.scriptSig;
+    txTo.InvalidateHash();
 
     // Test solution
     if (scriptPrereq.empty())
@@ -1279,6 +1569,59 @@ bool SignSignature(const CTransaction& txFrom, CTransaction& txTo, unsigned int
 }
 
 // @up4dev 验证签名
+//
+// Checks the two standard forms without running the concatenated script
+// through EvalScript.  The scriptSig has to be nothing but pushes that
+// parse cleanly, then each step below is what EvalScript would do with
+// scriptSig + OP_CODESEPARATOR + scriptPubKey.  Returns false if the
+// script isn't one it knows, otherwise fRet has the result.
+//
+static bool VerifyStandardScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo,
+                                 unsigned int nIn, int nHashType, bool& fRet)
+{
+    // Solver takes a bad opcode at the end as the end of the script,
+    // EvalScript fails on it
+    CDecodedScript decodedPubKey(scriptPubKey);
+    vector<pair<opcodetype, valtype> > vSolution;
+    if (!decodedPubKey.fComplete || !Solver(decodedPubKey, vSolution) || vSolution.size() != 1)
+        return false;
+
+    CDecodedScript decodedSig(scriptSig);
+    if (!decodedSig.fComplete || !decodedSig.IsPushOnly())
+        return false;
+    valtype vchSig;
+    valtype vchPubKey;
+    if (vSolution[0].first == OP_PUBKEY)
+    {
+        // <sig> | <pubkey> OP_CHECKSIG
+        if (decodedSig.vOp.size() != 1)
+            return false;
+        vchSig = decodedSig.vOp[0].GetData();
+        vchPubKey = vSolution[0].second;
+    }
+    else
+    {
+        // <sig> <pubkey> | OP_DUP OP_HASH160 <hash> OP_EQUALVERIFY OP_CHECKSIG
+        if (decodedSig.vOp.size() != 2)
+            return false;
+        vchSig = decodedSig.vOp[0].GetData();
+        vchPubKey = decodedSig.vOp[1].GetData();
+    }
+
+    if (vSolution[0].first == OP_PUBKEYHASH && Hash160(vchPubKey) != uint160(vSolution[0].second))
+    {
+        // OP_EQUALVERIFY leaves false on the stack and ends the script
+        fRet = false;
+        return true;
+    }
+
+    // The code separator puts the hash start at scriptPubKey
+    CScript scriptCode(scriptPubKey);
+    scriptCode.FindAndDelete(CScript(vchSig));
+    fRet = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+    return true;
+}
+
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
     assert(nIn < txTo.vin.size());
@@ -1290,5 +1633,18 @@ bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsig
     if (txin.prevout.hash != txFrom.GetHash())
         return false;
 
-    return EvalScript(txin.scriptSig + CScript(OP_CODESEPARATOR) + txout.scriptPubKey, txTo, nIn, nHashType);
+    return VerifySignature(txout.scriptPubKey, txTo, nIn, nHashType);
+}
+
+// Same with only the output being spent, when the caller already knows it's the right one
+bool VerifySignature(const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    assert(nIn < txTo.vin.size());
+    const CTxIn& txin = txTo.vin[nIn];
+
+    bool fRet;
+    if (VerifyStandardScript(txin.scriptSig, scriptPubKey, txTo, nIn, nHashType, fRet))
+        return fRet;
+
+    return EvalScript(txin.scriptSig + CScript(OP_CODESEPARATOR) + scriptPubKey, txTo, nIn, nHashType);
 }
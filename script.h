@@ -494,9 +494,22 @@ public:
     }
 
     bool GetOp(const_iterator& pc, opcodetype& opcodeRet, vector<unsigned char>& vchRet) const
+    {
+        const_iterator pvch;
+        if (!GetOpSpan(pc, opcodeRet, pvch))
+        {
+            vchRet.clear();
+            return false;
+        }
+        vchRet.assign(pvch, pc);
+        return true;
+    }
+
+    // Same as GetOp but without copying, the push data is [pvchRet, pc)
+    bool GetOpSpan(const_iterator& pc, opcodetype& opcodeRet, const_iterator& pvchRet) const
     {
         opcodeRet = OP_INVALIDOPCODE;
-        vchRet.clear();
+        pvchRet = pc;
         if (pc >= end())
             return false;
 
@@ -537,9 +550,13 @@ public:
             }
             if (pc + nSize > end())
                 return false;
-            vchRet.assign(pc, pc + nSize);
+            pvchRet = pc;
             pc += nSize;
         }
+        else
+        {
+            pvchRet = pc;
+        }
 
         opcodeRet = (opcodetype)opcode;
         return true;
@@ -597,6 +614,69 @@ public:
 
 
 
+//
+// A script parsed once into its opcodes, so the interpreter and the
+// template matching don't run GetOp and copy every push again.  Push data
+// points into the script's own bytes, the script has to outlive this and
+// stay unchanged.  If parsing hit a bad opcode, vOp has everything before
+// it and fComplete is false.
+//
+struct CScriptOp
+{
+    opcodetype opcode;
+    CScript::const_iterator pbegin;     // push data
+    CScript::const_iterator pend;       // end of push data, start of next op
+
+    unsigned int size() const { return pend - pbegin; }
+    vector<unsigned char> GetData() const { return vector<unsigned char>(pbegin, pend); }
+};
+
+class CDecodedScript
+{
+public:
+    vector<CScriptOp> vOp;
+    bool fComplete;
+
+    CDecodedScript()
+    {
+        fComplete = true;
+    }
+
+    explicit CDecodedScript(const CScript& script)
+    {
+        Decode(script);
+    }
+
+    void Decode(const CScript& script)
+    {
+        vOp.clear();
+        fComplete = true;
+        CScriptOp op;
+        CScript::const_iterator pc = script.begin();
+        while (pc < script.end())
+        {
+            if (!script.GetOpSpan(pc, op.opcode, op.pbegin))
+            {
+                fComplete = false;
+                break;
+            }
+            op.pend = pc;
+            vOp.push_back(op);
+        }
+    }
+
+    bool IsPushOnly() const
+    {
+        foreach(const CScriptOp& op, vOp)
+            if (op.opcode > OP_PUSHDATA4)
+                return false;
+        return true;
+    }
+};
+
+
+
+
 
 
 
@@ -604,8 +684,10 @@ public:
 bool EvalScript(const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType=0,
                 vector<vector<unsigned char> >* pvStackRet=NULL);
 uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool Solver(const CDecodedScript& scriptPubKey, vector<pair<opcodetype, vector<unsigned char> > >& vSolutionRet);
 bool IsMine(const CScript& scriptPubKey);
 bool ExtractPubKey(const CScript& scriptPubKey, bool fMineOnly, vector<unsigned char>& vchPubKeyRet);
 bool ExtractHash160(const CScript& scriptPubKey, uint160& hash160Ret);
 bool SignSignature(const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, CScript scriptPrereq=CScript());
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType=0);
+bool VerifySignature(const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType=0);
@@ -0,0 +1,801 @@
+// Copyright (c) 2009 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+#include <string.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+#include <openssl/rand.h>
+#include "secp256k1.h"
+
+#if defined(_MSC_VER) || defined(__BORLANDC__)
+typedef unsigned __int64 secp_uint64;
+#else
+typedef unsigned long long secp_uint64;
+#endif
+
+#ifdef __GNUC__
+#define SECP_INLINE inline __attribute__((always_inline))
+#else
+#define SECP_INLINE __forceinline
+#endif
+
+static const secp_uint64 SECP_MAX = ~(secp_uint64)0;
+
+// Field prime p = 2^256 - 0x1000003D1
+static const secp_uint64 pFieldP[4] = {0xFFFFFFFEFFFFFC2FULL, SECP_MAX, SECP_MAX, SECP_MAX};
+static const secp_uint64 nFieldC = 0x1000003D1ULL;
+static const secp_uint64 pFieldPMinus2[4] = {0xFFFFFFFEFFFFFC2DULL, SECP_MAX, SECP_MAX, SECP_MAX};
+
+// Group order n, and 2^256 - n
+static const secp_uint64 pOrderN[4] = {0xBFD25E8CD0364141ULL, 0xBAAEDCE6AF48A03BULL, 0xFFFFFFFFFFFFFFFEULL, SECP_MAX};
+static const secp_uint64 pOrderNC[4] = {0x402DA1732FC9BEBFULL, 0x4551231950B75FC4ULL, 1, 0};
+static const secp_uint64 pOrderNMinus2[4] = {0xBFD25E8CD036413FULL, 0xBAAEDCE6AF48A03BULL, 0xFFFFFFFFFFFFFFFEULL, SECP_MAX};
+
+// Generator
+static const secp_uint64 pGx[4] = {0x59F2815B16F81798ULL, 0x029BFCDB2DCE28D9ULL, 0x55A06295CE870B07ULL, 0x79BE667EF9DCBBACULL};
+static const secp_uint64 pGy[4] = {0x9C47D08FFB10D4B8ULL, 0xFD17B448A6855419ULL, 0x5DA4FBFC0E1108A8ULL, 0x483ADA7726A3C465ULL};
+
+// wNAF window for the public key, built per verify, and for the generator,
+// whose 2^(WINDOW_G-2) odd multiples are built once (64 bytes each)
+static const int WINDOW_Q = 5;
+static const int WINDOW_G = 12;
+
+static bool fNative = false;
+
+
+
+
+//
+// 256-bit integer helpers, little-endian 64-bit limbs
+//
+
+static SECP_INLINE secp_uint64 Mul64(secp_uint64 a, secp_uint64 b, secp_uint64& hi)
+{
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 r = (unsigned __int128)a * b;
+    hi = (secp_uint64)(r >> 64);
+    return (secp_uint64)r;
+#else
+    secp_uint64 a0 = (unsigned int)a, a1 = a >> 32;
+    secp_uint64 b0 = (unsigned int)b, b1 = b >> 32;
+    secp_uint64 p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+    secp_uint64 mid = (p00 >> 32) + (unsigned int)p01 + (unsigned int)p10;
+    hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+    return (mid << 32) | (unsigned int)p00;
+#endif
+}
+
+// (c0, c1, c2) += a * b
+static SECP_INLINE void MulAdd(secp_uint64& c0, secp_uint64& c1, secp_uint64& c2, secp_uint64 a, secp_uint64 b)
+{
+    secp_uint64 hi;
+    secp_uint64 lo = Mul64(a, b, hi);
+    c0 += lo;
+    hi += (c0 < lo);
+    c1 += hi;
+    c2 += (c1 < hi);
+}
+
+static void Mul256(secp_uint64 r[8], const secp_uint64 a[4], const secp_uint64 b[4])
+{
+    secp_uint64 c0 = 0, c1 = 0, c2 = 0;
+    for (int k = 0; k < 7; k++)
+    {
+        for (int i = (k > 3 ? k - 3 : 0); i <= (k < 3 ? k : 3); i++)
+            MulAdd(c0, c1, c2, a[i], b[k - i]);
+        r[k] = c0;
+        c0 = c1;
+        c1 = c2;
+        c2 = 0;
+    }
+    r[7] = c0;
+}
+
+static SECP_INLINE bool IsZero256(const secp_uint64 a[4])
+{
+    return (a[0] | a[1] | a[2] | a[3]) == 0;
+}
+
+static SECP_INLINE bool Equal256(const secp_uint64 a[4], const secp_uint64 b[4])
+{
+    return ((a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2]) | (a[3] ^ b[3])) == 0;
+}
+
+static bool GreaterOrEqual256(const secp_uint64 a[4], const secp_uint64 b[4])
+{
+    for (int i = 3; i >= 0; i--)
+        if (a[i] != b[i])
+            return a[i] > b[i];
+    return true;
+}
+
+// r = a - b, returns the borrow
+static secp_uint64 Sub256(secp_uint64 r[4], const secp_uint64 a[4], const secp_uint64 b[4])
+{
+    secp_uint64 nBorrow = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        secp_uint64 d = a[i] - b[i];
+        secp_uint64 nBorrowOut = (a[i] < b[i]);
+        nBorrowOut |= (d < nBorrow);
+        r[i] = d - nBorrow;
+        nBorrow = nBorrowOut;
+    }
+    return nBorrow;
+}
+
+// r = a + b, returns the carry
+static secp_uint64 Add256(secp_uint64 r[4], const secp_uint64 a[4], const secp_uint64 b[4])
+{
+    secp_uint64 nCarry = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        secp_uint64 s = a[i] + nCarry;
+        nCarry = (s < nCarry);
+        s += b[i];
+        nCarry += (s < b[i]);
+        r[i] = s;
+    }
+    return nCarry;
+}
+
+static void Set256FromBytes(secp_uint64 r[4], const unsigned char* pch, unsigned int nSize)
+{
+    // Big-endian, at most 32 bytes
+    r[0] = r[1] = r[2] = r[3] = 0;
+    for (unsigned int i = 0; i < nSize; i++)
+    {
+        unsigned int nByte = nSize - 1 - i;
+        r[nByte / 8] |= (secp_uint64)pch[i] << (8 * (nByte % 8));
+    }
+}
+
+// a^e for a prime modulus, 4-bit fixed window
+static void Pow256(secp_uint64 r[4], const secp_uint64 a[4], const secp_uint64 e[4],
+                   void (*pfnMul)(secp_uint64*, const secp_uint64*, const secp_uint64*))
+{
+    secp_uint64 pow[16][4];
+    memset(pow[0], 0, sizeof(pow[0]));
+    pow[0][0] = 1;
+    memcpy(pow[1], a, sizeof(pow[1]));
+    for (int i = 2; i < 16; i++)
+        pfnMul(pow[i], pow[i-1], a);
+
+    secp_uint64 acc[4];
+    memcpy(acc, pow[0], sizeof(acc));
+    for (int i = 63; i >= 0; i--)
+    {
+        for (int j = 0; j < 4; j++)
+            pfnMul(acc, acc, acc);
+        unsigned int nWindow = (e[i / 16] >> (4 * (i % 16))) & 15;
+        if (nWindow)
+            pfnMul(acc, acc, pow[nWindow]);
+    }
+    memcpy(r, acc, sizeof(acc));
+}
+
+
+
+
+//
+// Field elements mod p, always kept fully reduced
+//
+
+static SECP_INLINE void FieldNormalize(secp_uint64 r[4])
+{
+    // r >= p only when the top three limbs are all ones
+    if ((r[1] & r[2] & r[3]) == SECP_MAX && r[0] >= pFieldP[0])
+    {
+        r[0] -= pFieldP[0];
+        r[1] = r[2] = r[3] = 0;
+    }
+}
+
+static void FieldAdd(secp_uint64 r[4], const secp_uint64 a[4], const secp_uint64 b[4])
+{
+    if (Add256(r, a, b))
+    {
+        // a + b - 2^256 < p, adding 2^256 - p can't carry again
+        secp_uint64 c[4] = {nFieldC, 0, 0, 0};
+        Add256(r, r, c);
+    }
+    FieldNormalize(r);
+}
+
+static void FieldSub(secp_uint64 r[4], const secp_uint64 a[4], const secp_uint64 b[4])
+{
+    if (Sub256(r, a, b))
+    {
+        secp_uint64 c[4] = {nFieldC, 0, 0, 0};
+        Sub256(r, r, c);
+    }
+}
+
+static void FieldNegate(secp_uint64 r[4], const secp_uint64 a[4])
+{
+    if (IsZero256(a))
+        r[0] = r[1] = r[2] = r[3] = 0;
+    else
+        Sub256(r, pFieldP, a);
+}
+
+static void FieldMul(secp_uint64* r, const secp_uint64* a, const secp_uint64* b)
+{
+    secp_uint64 t[8];
+    Mul256(t, a, b);
+
+    // t = H*2^256 + L = L + H*C (mod p)
+    secp_uint64 u[4];
+    secp_uint64 nCarry = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        secp_uint64 hi;
+        secp_uint64 lo = Mul64(t[4+i], nFieldC, hi);
+        secp_uint64 s = t[i] + lo;
+        hi += (s < lo);
+        s += nCarry;
+        hi += (s < nCarry);
+        u[i] = s;
+        nCarry = hi;
+    }
+
+    // Fold the last 34 or so bits in the same way
+    secp_uint64 hi;
+    secp_uint64 lo = Mul64(nCarry, nFieldC, hi);
+    secp_uint64 s = u[0] + lo;
+    nCarry = hi + (s < lo);
+    r[0] = s;
+    for (int i = 1; i < 4; i++)
+    {
+        s = u[i] + nCarry;
+        nCarry = (s < nCarry);
+        r[i] = s;
+    }
+    if (nCarry)
+    {
+        // Wrapped past 2^256 with a tiny remainder, add 2^256 - p once more
+        secp_uint64 c[4] = {nFieldC, 0, 0, 0};
+        Add256(r, r, c);
+    }
+    FieldNormalize(r);
+}
+
+static SECP_INLINE void FieldSqr(secp_uint64 r[4], const secp_uint64 a[4])
+{
+    FieldMul(r, a, a);
+}
+
+static void FieldInverse(secp_uint64 r[4], const secp_uint64 a[4])
+{
+    Pow256(r, a, pFieldPMinus2, FieldMul);
+}
+
+
+
+
+//
+// Scalars mod n
+//
+
+static void ScalarReduce512(secp_uint64 r[4], const secp_uint64 tIn[8])
+{
+    secp_uint64 t[8];
+    memcpy(t, tIn, sizeof(t));
+
+    // t = H*2^256 + L = L + H*(2^256 - n) (mod n), each round takes off about 127 bits
+    while ((t[4] | t[5] | t[6] | t[7]) != 0)
+    {
+        secp_uint64 h[8];
+        Mul256(h, t + 4, pOrderNC);
+        secp_uint64 nCarry = Add256(t, t, h);
+        for (int i = 4; i < 8; i++)
+        {
+            t[i] = h[i] + nCarry;
+            nCarry = (t[i] < nCarry);
+        }
+    }
+    while (GreaterOrEqual256(t, pOrderN))
+        Sub256(t, t, pOrderN);
+    memcpy(r, t, 4 * sizeof(secp_uint64));
+}
+
+static void ScalarMul(secp_uint64* r, const secp_uint64* a, const secp_uint64* b)
+{
+    secp_uint64 t[8];
+    Mul256(t, a, b);
+    ScalarReduce512(r, t);
+}
+
+static void ScalarInverse(secp_uint64 r[4], const secp_uint64 a[4])
+{
+    Pow256(r, a, pOrderNMinus2, ScalarMul);
+}
+
+// Width-w NAF digits of a scalar < 2^256, least significant first, returns the length
+static int ScalarWNAF(int* pnDigits, const secp_uint64 a[4], int w)
+{
+    secp_uint64 k[5] = {a[0], a[1], a[2], a[3], 0};
+    int nLen = 0;
+    while ((k[0] | k[1] | k[2] | k[3] | k[4]) != 0)
+    {
+        int nDigit = 0;
+        if (k[0] & 1)
+        {
+            nDigit = (int)(k[0] & ((1 << w) - 1));
+            if (nDigit >= (1 << (w - 1)))
+                nDigit -= (1 << w);
+
+            // k -= nDigit
+            if (nDigit > 0)
+            {
+                secp_uint64 nBorrow = (k[0] < (secp_uint64)nDigit);
+                k[0] -= nDigit;
+                for (int i = 1; i < 5 && nBorrow; i++)
+                    nBorrow = (k[i]-- == 0);
+            }
+            else
+            {
+                secp_uint64 nAdd = -nDigit;
+                k[0] += nAdd;
+                secp_uint64 nCarry = (k[0] < nAdd);
+                for (int i = 1; i < 5 && nCarry; i++)
+                    nCarry = (++k[i] == 0);
+            }
+        }
+        pnDigits[nLen++] = nDigit;
+        for (int i = 0; i < 4; i++)
+            k[i] = (k[i] >> 1) | (k[i+1] << 63);
+        k[4] >>= 1;
+    }
+    return nLen;
+}
+
+
+
+
+//
+// Points in Jacobian coordinates, (X/Z^2, Y/Z^3), and affine ones
+//
+
+struct CPointJ
+{
+    secp_uint64 x[4];
+    secp_uint64 y[4];
+    secp_uint64 z[4];
+    bool fInfinity;
+};
+
+struct CPointA
+{
+    secp_uint64 x[4];
+    secp_uint64 y[4];
+};
+
+static void PointDouble(CPointJ& r, const CPointJ& a)
+{
+    if (a.fInfinity || IsZero256(a.y))
+    {
+        r.fInfinity = true;
+        return;
+    }
+
+    secp_uint64 yy[4], s[4], m[4], t[4], yyyy[4];
+    FieldSqr(yy, a.y);
+
+    // S = 4*X*Y^2
+    FieldMul(s, a.x, yy);
+    FieldAdd(s, s, s);
+    FieldAdd(s, s, s);
+
+    // M = 3*X^2
+    FieldSqr(t, a.x);
+    FieldAdd(m, t, t);
+    FieldAdd(m, m, t);
+
+    // Z3 = 2*Y*Z, before y is overwritten when r is a
+    FieldMul(r.z, a.y, a.z);
+    FieldAdd(r.z, r.z, r.z);
+
+    // X3 = M^2 - 2*S
+    FieldSqr(t, m);
+    FieldSub(t, t, s);
+    FieldSub(r.x, t, s);
+
+    // Y3 = M*(S - X3) - 8*Y^4
+    FieldSqr(yyyy, yy);
+    FieldAdd(yyyy, yyyy, yyyy);
+    FieldAdd(yyyy, yyyy, yyyy);
+    FieldAdd(yyyy, yyyy, yyyy);
+    FieldSub(t, s, r.x);
+    FieldMul(t, m, t);
+    FieldSub(r.y, t, yyyy);
+    r.fInfinity = false;
+}
+
+// Finishes an addition given U1, S1, H = U2 - U1, R = S2 - S1 and Z3 / H
+static void PointAddFinish(CPointJ& r, const secp_uint64 u1[4], const secp_uint64 s1[4],
+                           const secp_uint64 h[4], const secp_uint64 rr[4], const secp_uint64 zh[4])
+{
+    secp_uint64 hh[4], hhh[4], v[4], t[4];
+    FieldSqr(hh, h);
+    FieldMul(hhh, h, hh);
+    FieldMul(v, u1, hh);
+    FieldMul(r.z, zh, h);
+
+    // X3 = R^2 - H^3 - 2*U1*H^2
+    FieldSqr(t, rr);
+    FieldSub(t, t, hhh);
+    FieldSub(t, t, v);
+    FieldSub(r.x, t, v);
+
+    // Y3 = R*(U1*H^2 - X3) - S1*H^3
+    FieldSub(t, v, r.x);
+    FieldMul(t, rr, t);
+    FieldMul(hhh, s1, hhh);
+    FieldSub(r.y, t, hhh);
+    r.fInfinity = false;
+}
+
+// r = a + b with b affine, r may be a
+static void PointAddAffine(CPointJ& r, const CPointJ& a, const CPointA& b)
+{
+    if (a.fInfinity)
+    {
+        memcpy(r.x, b.x, sizeof(r.x));
+        memcpy(r.y, b.y, sizeof(r.y));
+        memset(r.z, 0, sizeof(r.z));
+        r.z[0] = 1;
+        r.fInfinity = false;
+        return;
+    }
+
+    secp_uint64 zz[4], u2[4], s2[4], h[4], rr[4];
+    FieldSqr(zz, a.z);
+    FieldMul(u2, b.x, zz);
+    FieldMul(s2, b.y, zz);
+    FieldMul(s2, s2, a.z);
+    FieldSub(h, u2, a.x);
+    FieldSub(rr, s2, a.y);
+    if (IsZero256(h))
+    {
+        if (IsZero256(rr))
+            PointDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+
+    secp_uint64 u1[4], s1[4], z[4];
+    memcpy(u1, a.x, sizeof(u1));
+    memcpy(s1, a.y, sizeof(s1));
+    memcpy(z, a.z, sizeof(z));
+    PointAddFinish(r, u1, s1, h, rr, z);
+}
+
+// r = a + b, r may be a
+static void PointAdd(CPointJ& r, const CPointJ& a, const CPointJ& b)
+{
+    if (a.fInfinity)
+    {
+        r = b;
+        return;
+    }
+    if (b.fInfinity)
+    {
+        r = a;
+        return;
+    }
+
+    secp_uint64 z1z1[4], z2z2[4], u1[4], u2[4], s1[4], s2[4], h[4], rr[4];
+    FieldSqr(z1z1, a.z);
+    FieldSqr(z2z2, b.z);
+    FieldMul(u1, a.x, z2z2);
+    FieldMul(u2, b.x, z1z1);
+    FieldMul(s1, a.y, z2z2);
+    FieldMul(s1, s1, b.z);
+    FieldMul(s2, b.y, z1z1);
+    FieldMul(s2, s2, a.z);
+    FieldSub(h, u2, u1);
+    FieldSub(rr, s2, s1);
+    if (IsZero256(h))
+    {
+        if (IsZero256(rr))
+            PointDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+
+    secp_uint64 zz[4];
+    FieldMul(zz, a.z, b.z);
+    PointAddFinish(r, u1, s1, h, rr, zz);
+}
+
+
+
+
+//
+// Odd multiples G, 3G, 5G, ... of the generator in affine coordinates
+//
+static CPointA pGTable[1 << (WINDOW_G - 2)];
+
+static void BuildGeneratorTable()
+{
+    const int nSize = 1 << (WINDOW_G - 2);
+    CPointJ* pJ = new CPointJ[nSize];
+    CPointJ g2;
+    memcpy(pJ[0].x, pGx, sizeof(pGx));
+    memcpy(pJ[0].y, pGy, sizeof(pGy));
+    memset(pJ[0].z, 0, sizeof(pJ[0].z));
+    pJ[0].z[0] = 1;
+    pJ[0].fInfinity = false;
+    PointDouble(g2, pJ[0]);
+    for (int i = 1; i < nSize; i++)
+        PointAdd(pJ[i], pJ[i-1], g2);
+
+    // Batch inversion of the Zs with a single field inverse
+    secp_uint64 (*pProd)[4] = new secp_uint64[nSize][4];
+    memcpy(pProd[0], pJ[0].z, sizeof(pProd[0]));
+    for (int i = 1; i < nSize; i++)
+        FieldMul(pProd[i], pProd[i-1], pJ[i].z);
+    secp_uint64 inv[4];
+    FieldInverse(inv, pProd[nSize-1]);
+    for (int i = nSize - 1; i >= 0; i--)
+    {
+        secp_uint64 zinv[4], zinv2[4], zinv3[4];
+        if (i > 0)
+        {
+            FieldMul(zinv, inv, pProd[i-1]);
+            FieldMul(inv, inv, pJ[i].z);
+        }
+        else
+        {
+            memcpy(zinv, inv, sizeof(zinv));
+        }
+        FieldSqr(zinv2, zinv);
+        FieldMul(zinv3, zinv2, zinv);
+        FieldMul(pGTable[i].x, pJ[i].x, zinv2);
+        FieldMul(pGTable[i].y, pJ[i].y, zinv3);
+    }
+    delete[] pProd;
+    delete[] pJ;
+}
+
+
+
+
+//
+// ECDSA verification
+//
+
+// Strict DER integer in (0, n), false for anything unusual
+static bool ParseDERScalar(secp_uint64 r[4], const unsigned char* pch, unsigned int nSize)
+{
+    if (nSize == 0 || nSize > 33)
+        return false;
+    if (pch[0] & 0x80)
+        return false;
+    if (pch[0] == 0)
+    {
+        if (nSize == 1 || !(pch[1] & 0x80))
+            return false;
+        pch++;
+        nSize--;
+    }
+    if (nSize > 32)
+        return false;
+    Set256FromBytes(r, pch, nSize);
+    return !IsZero256(r) && !GreaterOrEqual256(r, pOrderN);
+}
+
+static int VerifyNative(const unsigned char* pchPubKey, unsigned int nPubKeySize, const unsigned char* pchHash,
+                        const unsigned char* pchSig, unsigned int nSigSize)
+{
+    // Signature: 0x30 len 0x02 lenR R 0x02 lenS S
+    if (nSigSize < 8 || nSigSize > 72)
+        return -1;
+    if (pchSig[0] != 0x30 || pchSig[1] != nSigSize - 2 || pchSig[2] != 0x02)
+        return -1;
+    unsigned int nLenR = pchSig[3];
+    if (5 + nLenR >= nSigSize || pchSig[4 + nLenR] != 0x02)
+        return -1;
+    unsigned int nLenS = pchSig[5 + nLenR];
+    if (6 + nLenR + nLenS != nSigSize)
+        return -1;
+    secp_uint64 sigr[4], sigs[4];
+    if (!ParseDERScalar(sigr, pchSig + 4, nLenR) || !ParseDERScalar(sigs, pchSig + 6 + nLenR, nLenS))
+        return -1;
+
+    // Public key: 0x04 X Y, on the curve
+    if (nPubKeySize != 65 || pchPubKey[0] != 0x04)
+        return -1;
+    CPointA q;
+    Set256FromBytes(q.x, pchPubKey + 1, 32);
+    Set256FromBytes(q.y, pchPubKey + 33, 32);
+    if (GreaterOrEqual256(q.x, pFieldP) || GreaterOrEqual256(q.y, pFieldP))
+        return -1;
+    secp_uint64 lhs[4], rhs[4], seven[4] = {7, 0, 0, 0};
+    FieldSqr(lhs, q.y);
+    FieldSqr(rhs, q.x);
+    FieldMul(rhs, rhs, q.x);
+    FieldAdd(rhs, rhs, seven);
+    if (!Equal256(lhs, rhs))
+        return -1;
+
+    // u1 = z/s, u2 = r/s
+    secp_uint64 z[4], w[4], u1[4], u2[4];
+    Set256FromBytes(z, pchHash, 32);
+    if (GreaterOrEqual256(z, pOrderN))
+        Sub256(z, z, pOrderN);
+    ScalarInverse(w, sigs);
+    ScalarMul(u1, z, w);
+    ScalarMul(u2, sigr, w);
+
+    // Odd multiples Q, 3Q, ... for the public key's digits
+    const int nSizeQ = 1 << (WINDOW_Q - 2);
+    CPointJ pQTable[1 << (WINDOW_Q - 2)];
+    memcpy(pQTable[0].x, q.x, sizeof(q.x));
+    memcpy(pQTable[0].y, q.y, sizeof(q.y));
+    memset(pQTable[0].z, 0, sizeof(pQTable[0].z));
+    pQTable[0].z[0] = 1;
+    pQTable[0].fInfinity = false;
+    CPointJ q2;
+    PointDouble(q2, pQTable[0]);
+    for (int i = 1; i < nSizeQ; i++)
+        PointAdd(pQTable[i], pQTable[i-1], q2);
+
+    // R = u1*G + u2*Q
+    int pnDigits1[258], pnDigits2[258];
+    int nLen1 = ScalarWNAF(pnDigits1, u1, WINDOW_G);
+    int nLen2 = ScalarWNAF(pnDigits2, u2, WINDOW_Q);
+    CPointJ r;
+    r.fInfinity = true;
+    for (int i = (nLen1 > nLen2 ? nLen1 : nLen2) - 1; i >= 0; i--)
+    {
+        PointDouble(r, r);
+        if (i < nLen2 && pnDigits2[i] != 0)
+        {
+            int nDigit = pnDigits2[i];
+            if (nDigit > 0)
+            {
+                PointAdd(r, r, pQTable[nDigit / 2]);
+            }
+            else
+            {
+                CPointJ neg = pQTable[-nDigit / 2];
+                FieldNegate(neg.y, neg.y);
+                PointAdd(r, r, neg);
+            }
+        }
+        if (i < nLen1 && pnDigits1[i] != 0)
+        {
+            int nDigit = pnDigits1[i];
+            if (nDigit > 0)
+            {
+                PointAddAffine(r, r, pGTable[nDigit / 2]);
+            }
+            else
+            {
+                CPointA neg = pGTable[-nDigit / 2];
+                FieldNegate(neg.y, neg.y);
+                PointAddAffine(r, r, neg);
+            }
+        }
+    }
+    if (r.fInfinity)
+        return 0;
+
+    // R.x mod n == r, compared as X == r*Z^2 without an inversion.  R.x can
+    // also be r + n when that's still below p.
+    secp_uint64 zz[4], t[4];
+    FieldSqr(zz, r.z);
+    FieldMul(t, sigr, zz);
+    if (Equal256(t, r.x))
+        return 1;
+    secp_uint64 rn[4];
+    if (Add256(rn, sigr, pOrderN) == 0 && !GreaterOrEqual256(rn, pFieldP))
+    {
+        FieldMul(t, rn, zz);
+        if (Equal256(t, r.x))
+            return 1;
+    }
+    return 0;
+}
+
+int Secp256k1Verify(const unsigned char* pchPubKey, unsigned int nPubKeySize, const unsigned char* pchHash,
+                    const unsigned char* pchSig, unsigned int nSigSize)
+{
+    if (!fNative)
+        return -1;
+    return VerifyNative(pchPubKey, nPubKeySize, pchHash, pchSig, nSigSize);
+}
+
+bool Secp256k1SelfTest()
+{
+    // Cross-check against OpenSSL with fresh keys, good signatures, the
+    // high-S twin of each signature and a tampered hash
+    EC_KEY* pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    if (pkey == NULL)
+        return false;
+    bool fOk = true;
+    for (int n = 0; n < 16 && fOk; n++)
+    {
+        if (n % 4 == 0 && !EC_KEY_generate_key(pkey))
+        {
+            fOk = false;
+            break;
+        }
+        unsigned char pchPubKey[65];
+        unsigned char* pbegin = pchPubKey;
+        if (i2o_ECPublicKey(pkey, NULL) != sizeof(pchPubKey) || i2o_ECPublicKey(pkey, &pbegin) != sizeof(pchPubKey))
+        {
+            fOk = false;
+            break;
+        }
+
+        unsigned char pchHash[32];
+        RAND_bytes(pchHash, sizeof(pchHash));
+        if (n == 1)
+            memset(pchHash, 0xff, sizeof(pchHash));
+        unsigned char pchSig[80];
+        unsigned int nSigSize = 0;
+        if (!ECDSA_sign(0, pchHash, sizeof(pchHash), pchSig, &nSigSize, pkey))
+        {
+            fOk = false;
+            break;
+        }
+
+        for (int nCase = 0; nCase < 2 && fOk; nCase++)
+        {
+            unsigned char pchHashTest[32];
+            memcpy(pchHashTest, pchHash, sizeof(pchHashTest));
+            if (nCase == 1)
+                pchHashTest[n % 32] ^= 1 << (n % 8);
+            int nExpected = (ECDSA_verify(0, pchHashTest, sizeof(pchHashTest), pchSig, nSigSize, pkey) == 1);
+            if (VerifyNative(pchPubKey, sizeof(pchPubKey), pchHashTest, pchSig, nSigSize) != nExpected)
+                fOk = false;
+        }
+
+        // Same signature with s replaced by n - s
+        unsigned int nLenR = pchSig[3];
+        secp_uint64 sigr[4], sigs[4];
+        if (nSigSize > 72 || !ParseDERScalar(sigr, pchSig + 4, nLenR) ||
+            !ParseDERScalar(sigs, pchSig + 6 + nLenR, pchSig[5 + nLenR]))
+        {
+            fOk = false;
+            break;
+        }
+        Sub256(sigs, pOrderN, sigs);
+        nSigSize = 4 + nLenR;
+        pchSig[nSigSize++] = 0x02;
+        unsigned char pchS[33];
+        pchS[0] = 0;
+        for (int i = 0; i < 32; i++)
+            pchS[1 + i] = (unsigned char)(sigs[3 - i / 8] >> (8 * (7 - i % 8)));
+        int nSkip = 0;
+        while (nSkip < 32 && pchS[nSkip] == 0 && !(pchS[nSkip + 1] & 0x80))
+            nSkip++;
+        pchSig[nSigSize++] = 33 - nSkip;
+        memcpy(pchSig + nSigSize, pchS + nSkip, 33 - nSkip);
+        nSigSize += 33 - nSkip;
+        pchSig[1] = nSigSize - 2;
+        int nExpected = (ECDSA_verify(0, pchHash, sizeof(pchHash), pchSig, nSigSize, pkey) == 1);
+        if (VerifyNative(pchPubKey, sizeof(pchPubKey), pchHash, pchSig, nSigSize) != nExpected || nExpected != 1)
+            fOk = false;
+    }
+    EC_KEY_free(pkey);
+    return fOk;
+}
+
+const char* Secp256k1AutoDetect()
+{
+    BuildGeneratorTable();
+    if (Secp256k1SelfTest())
+    {
+        fNative = true;
+        return "native secp256k1";
+    }
+    return "OpenSSL (native secp256k1 failed self-test)";
+}
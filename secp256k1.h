@@ -0,0 +1,25 @@
+// Copyright (c) 2009 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+
+//
+// ECDSA verification on secp256k1 without going through OpenSSL's generic
+// EC code.  Field and scalar arithmetic are on fixed 4x64-bit limbs, u1*G
+// comes from a precomputed table of odd multiples of the generator and
+// u1*G + u2*Q is done in one pass with wNAF digits.
+//
+// Only strict DER signatures and uncompressed public keys are handled
+// natively, anything else returns -1 and is left to OpenSSL so the two can
+// never disagree about what an unusual encoding means.  The native code is
+// only turned on once Secp256k1AutoDetect() has cross-checked it against
+// OpenSSL's ECDSA_verify.
+//
+
+// Returns 1 if the signature is good, 0 if it's bad, -1 if OpenSSL should decide
+int Secp256k1Verify(const unsigned char* pchPubKey, unsigned int nPubKeySize, const unsigned char* pchHash,
+                    const unsigned char* pchSig, unsigned int nSigSize);
+
+// Builds the generator table and runs the self-test, returns the engine's name
+const char* Secp256k1AutoDetect();
+bool Secp256k1SelfTest();
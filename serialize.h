@@ -1242,3 +1242,58 @@ public:
         return (*this);
     }
 };
+
+
+
+
+//
+// Read-only stream over memory that someone else owns, such as a mapped
+// file.  Reading past the end throws like CAutoFile does, nShortBy is then
+// how many more bytes that read needed.
+//
+class CMemoryReader
+{
+protected:
+    const char* pcur;
+    const char* pend;
+public:
+    int nType;
+    int nVersion;
+    unsigned int nShortBy;
+
+    CMemoryReader(const char* pbeginIn, const char* pendIn, int nTypeIn=SER_DISK, int nVersionIn=VERSION)
+    {
+        pcur = pbeginIn;
+        pend = pendIn;
+        nType = nTypeIn;
+        nVersion = nVersionIn;
+        nShortBy = 0;
+    }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+
+    CMemoryReader& read(char* pch, int nSize)
+    {
+        if (nSize < 0)
+            throw std::ios_base::failure("CMemoryReader::read : bad size");
+        if (nSize > pend - pcur)
+        {
+            nShortBy = nSize - (pend - pcur);
+            throw std::ios_base::failure("CMemoryReader::read : end of data");
+        }
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CMemoryReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
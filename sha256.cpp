@@ -0,0 +1,585 @@
+// Copyright (c) 2009 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+#include <string.h>
+#include <openssl/sha.h>
+#include "sha256.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_SIMD_SHA256 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#ifdef __GNUC__
+#define SHA256_INLINE inline __attribute__((always_inline))
+#else
+#define SHA256_INLINE __forceinline
+#endif
+
+
+
+static const unsigned int pSHA256InitState[8] =
+{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static const unsigned int pSHA256K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline unsigned int ReadBE32(const unsigned char* p)
+{
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+static inline unsigned int ByteSwap32(unsigned int n)
+{
+    return (n >> 24) | ((n >> 8) & 0x0000ff00) | ((n << 8) & 0x00ff0000) | (n << 24);
+}
+
+static inline void WriteBE32(unsigned char* p, unsigned int n)
+{
+    p[0] = n >> 24;
+    p[1] = n >> 16;
+    p[2] = n >> 8;
+    p[3] = n;
+}
+
+
+
+//
+// Single-buffer transforms
+//
+
+// OpenSSL's block function, which Hash() used before and which stays the
+// fallback and the reference for the self-test
+static void SHA256Transform_OpenSSL(unsigned int* pstate, const unsigned char* pchIn, unsigned int nBlocks)
+{
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    for (int i = 0; i < 8; i++)
+        ctx.h[i] = pstate[i];
+    for (unsigned int n = 0; n < nBlocks; n++, pchIn += 64)
+        SHA256_Transform(&ctx, pchIn);
+    for (int i = 0; i < 8; i++)
+        pstate[i] = ctx.h[i];
+}
+
+#ifdef USE_SIMD_SHA256
+// The SHA instructions keep the state as ABEF and CDGH halves and do two
+// rounds per sha256rnds2, so each step below is four rounds.
+__attribute__((target("sha,sse4.1")))
+static void SHA256Transform_SHANI(unsigned int* pstate, const unsigned char* pchIn, unsigned int nBlocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // Load state and shuffle it into ABEF/CDGH order
+    __m128i s0 = _mm_loadu_si128((const __m128i*)pstate);
+    __m128i s1 = _mm_loadu_si128((const __m128i*)(pstate + 4));
+    __m128i t1 = _mm_shuffle_epi32(s0, 0xB1);
+    __m128i t2 = _mm_shuffle_epi32(s1, 0x1B);
+    s0 = _mm_alignr_epi8(t1, t2, 8);
+    s1 = _mm_blend_epi16(t2, t1, 0xF0);
+
+    for (unsigned int n = 0; n < nBlocks; n++, pchIn += 64)
+    {
+        __m128i so0 = s0;
+        __m128i so1 = s1;
+        __m128i m[4];
+        for (int q = 0; q < 16; q++)
+        {
+            if (q < 4)
+                m[q] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pchIn + 16 * q)), mask);
+            __m128i msg = _mm_add_epi32(m[q&3], _mm_loadu_si128((const __m128i*)&pSHA256K[4 * q]));
+            s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+            s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0E));
+
+            // Message schedule, m[q+1] is due next
+            if (q >= 3 && q <= 14)
+                m[(q+1)&3] = _mm_sha256msg2_epu32(_mm_add_epi32(m[(q+1)&3], _mm_alignr_epi8(m[q&3], m[(q-1)&3], 4)), m[q&3]);
+            if (q >= 1 && q <= 12)
+                m[(q-1)&3] = _mm_sha256msg1_epu32(m[(q-1)&3], m[q&3]);
+        }
+        s0 = _mm_add_epi32(s0, so0);
+        s1 = _mm_add_epi32(s1, so1);
+    }
+
+    // Shuffle back to ABCD/EFGH and store
+    t1 = _mm_shuffle_epi32(s0, 0x1B);
+    t2 = _mm_shuffle_epi32(s1, 0xB1);
+    s0 = _mm_blend_epi16(t1, t2, 0xF0);
+    s1 = _mm_alignr_epi8(t2, t1, 8);
+    _mm_storeu_si128((__m128i*)pstate, s0);
+    _mm_storeu_si128((__m128i*)(pstate + 4), s1);
+}
+
+static bool HasSHANI()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    // SSSE3 and SSE4.1 for the shuffles around the SHA instructions
+    if (!(ecx & (1 << 9)) || !(ecx & (1 << 19)))
+        return false;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 29)) != 0;
+}
+#endif
+
+typedef void (*TransformFn)(unsigned int*, const unsigned char*, unsigned int);
+static TransformFn pTransform = SHA256Transform_OpenSSL;
+
+void SHA256Transform(unsigned int* pstate, const void* pin, unsigned int nBlocks)
+{
+    pTransform(pstate, (const unsigned char*)pin, nBlocks);
+}
+
+bool SHA256SelfTest()
+{
+    // Known answers for "", "abc" and the two block FIPS 180-2 example
+    static const char* pszTests[3] = {"", "abc", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"};
+    static const unsigned int pExpected[3][8] =
+    {
+        {0xe3b0c442, 0x98fc1c14, 0x9afbf4c8, 0x996fb924, 0x27ae41e4, 0x649b934c, 0xa495991b, 0x7852b855},
+        {0xba7816bf, 0x8f01cfea, 0x414140de, 0x5dae2223, 0xb00361a3, 0x96177a9c, 0xb410ff61, 0xf20015ad},
+        {0x248d6a61, 0xd20638b8, 0xe5c02693, 0x0c3e6039, 0xa33ce459, 0x64ff2167, 0xf6ecedd4, 0x19db06c1},
+    };
+    for (int n = 0; n < 3; n++)
+    {
+        unsigned char pchHash[32];
+        CSHA256().Write((const unsigned char*)pszTests[n], strlen(pszTests[n])).Finalize(pchHash);
+        for (int i = 0; i < 8; i++)
+            if (ReadBE32(pchHash + 4 * i) != pExpected[n][i])
+                return false;
+    }
+
+    // The selected transform must agree with OpenSSL's on arbitrary states
+    // and runs of blocks
+    unsigned char pchData[4 * 64];
+    for (int i = 0; i < sizeof(pchData); i++)
+        pchData[i] = (unsigned char)(i * 167 + 13);
+    for (unsigned int nBlocks = 1; nBlocks <= 4; nBlocks++)
+    {
+        unsigned int pstate1[8];
+        unsigned int pstate2[8];
+        for (int i = 0; i < 8; i++)
+            pstate1[i] = pstate2[i] = pSHA256InitState[i] ^ (nBlocks * 0x9e3779b9 * (i + 1));
+        pTransform(pstate1, pchData, nBlocks);
+        SHA256Transform_OpenSSL(pstate2, pchData, nBlocks);
+        if (memcmp(pstate1, pstate2, sizeof(pstate1)) != 0)
+            return false;
+    }
+    return true;
+}
+
+const char* SHA256AutoDetect()
+{
+#ifdef USE_SIMD_SHA256
+    if (HasSHANI())
+    {
+        pTransform = SHA256Transform_SHANI;
+        if (SHA256SelfTest())
+            return "SHA-NI";
+        pTransform = SHA256Transform_OpenSSL;
+        return "OpenSSL (SHA-NI failed self-test)";
+    }
+#endif
+    return "OpenSSL";
+}
+
+
+
+//
+// CSHA256
+//
+
+CSHA256& CSHA256::Reset()
+{
+    memcpy(pstate, pSHA256InitState, sizeof(pstate));
+    nBytes = 0;
+    return *this;
+}
+
+CSHA256& CSHA256::Write(const unsigned char* pch, size_t nLen)
+{
+    const unsigned char* pend = pch + nLen;
+    size_t nBufSize = nBytes % 64;
+    if (nBufSize && nBufSize + nLen >= 64)
+    {
+        // Complete the buffered block
+        memcpy(pchBuf + nBufSize, pch, 64 - nBufSize);
+        nBytes += 64 - nBufSize;
+        pch += 64 - nBufSize;
+        pTransform(pstate, pchBuf, 1);
+        nBufSize = 0;
+    }
+    if (pend - pch >= 64)
+    {
+        // Hash whole blocks straight from the input
+        size_t nBlocks = (pend - pch) / 64;
+        pTransform(pstate, pch, nBlocks);
+        pch += 64 * nBlocks;
+        nBytes += 64 * nBlocks;
+    }
+    if (pend > pch)
+    {
+        memcpy(pchBuf + nBufSize, pch, pend - pch);
+        nBytes += pend - pch;
+    }
+    return *this;
+}
+
+void CSHA256::Finalize(unsigned char* pchHash)
+{
+    static const unsigned char pchPad[64] = {0x80};
+    unsigned char pchSize[8];
+    sha256_uint64 nBits = nBytes << 3;
+    WriteBE32(pchSize, (unsigned int)(nBits >> 32));
+    WriteBE32(pchSize + 4, (unsigned int)nBits);
+    Write(pchPad, 1 + ((119 - (nBytes % 64)) % 64));
+    Write(pchSize, 8);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(pchHash + 4 * i, pstate[i]);
+}
+
+
+
+//
+// Lane-generic compression function.  V is either a plain unsigned int or a
+// GCC vector of unsigned ints, which support the same operators, so the one
+// template gives the scalar, SSE2 and AVX2 kernels.
+//
+
+#define ROTR(x,n)   (((x) >> (n)) | ((x) << (32-(n))))
+#define Ch(x,y,z)   ((z) ^ ((x) & ((y) ^ (z))))
+#define Maj(x,y,z)  (((x) & (y)) | ((z) & ((x) | (y))))
+#define S0(x)       (ROTR(x, 2) ^ ROTR(x,13) ^ ROTR(x,22))
+#define S1(x)       (ROTR(x, 6) ^ ROTR(x,11) ^ ROTR(x,25))
+#define s0(x)       (ROTR(x, 7) ^ ROTR(x,18) ^ ((x) >> 3))
+#define s1(x)       (ROTR(x,17) ^ ROTR(x,19) ^ ((x) >> 10))
+
+template<typename V>
+static SHA256_INLINE void TransformLanes(V* pstate, V* W)
+{
+    V a = pstate[0], b = pstate[1], c = pstate[2], d = pstate[3];
+    V e = pstate[4], f = pstate[5], g = pstate[6], h = pstate[7];
+    for (int i = 0; i < 64; i++)
+    {
+        if (i >= 16)
+            W[i&15] += s1(W[(i-2)&15]) + W[(i-7)&15] + s0(W[(i-15)&15]);
+        V t1 = h + S1(e) + Ch(e, f, g) + pSHA256K[i] + W[i&15];
+        V t2 = S0(a) + Maj(a, b, c);
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    pstate[0] += a; pstate[1] += b; pstate[2] += c; pstate[3] += d;
+    pstate[4] += e; pstate[5] += f; pstate[6] += g; pstate[7] += h;
+}
+
+template<typename V, int N>
+static SHA256_INLINE bool ScanHashLanes(const unsigned int* pmidstate, const void* pdata, const unsigned int* ptarget,
+                                        unsigned int nNonce, unsigned int nCount, unsigned int& nNonceRet)
+{
+    const unsigned char* pchData = (const unsigned char*)pdata;
+    const V zero = V();
+    V pdata0 = zero + ReadBE32(pchData);
+    V pdata1 = zero + ReadBE32(pchData + 4);
+    V pdata2 = zero + ReadBE32(pchData + 8);
+
+    for (unsigned int n = 0; n < nCount; n += N)
+    {
+        // Second block of the header, starting from the midstate
+        unsigned int pnonce[N];
+        for (int j = 0; j < N; j++)
+            pnonce[j] = ByteSwap32(nNonce + n + j);
+        V W[16];
+        V state[8];
+        W[0] = pdata0;
+        W[1] = pdata1;
+        W[2] = pdata2;
+        memcpy(&W[3], pnonce, sizeof(V));
+        W[4] = zero + 0x80000000;
+        for (int i = 5; i < 15; i++)
+            W[i] = zero;
+        W[15] = zero + 80 * 8;
+        for (int i = 0; i < 8; i++)
+            state[i] = zero + pmidstate[i];
+        TransformLanes(state, W);
+
+        // Hash the 32 byte result again
+        for (int i = 0; i < 8; i++)
+        {
+            W[i] = state[i];
+            state[i] = zero + pSHA256InitState[i];
+        }
+        W[8] = zero + 0x80000000;
+        for (int i = 9; i < 15; i++)
+            W[i] = zero;
+        W[15] = zero + 32 * 8;
+        TransformLanes(state, W);
+
+        // The most significant word of the hash is the byte swapped last
+        // word of the state, and is almost never below the target
+        unsigned int phash7[N];
+        memcpy(phash7, &state[7], sizeof(V));
+        for (int j = 0; j < N && n + j < nCount; j++)
+        {
+            if (ByteSwap32(phash7[j]) > ptarget[7])
+                continue;
+            unsigned int phash[8][N];
+            memcpy(phash, state, sizeof(phash));
+            int i = 7;
+            while (i >= 0 && ByteSwap32(phash[i][j]) == ptarget[i])
+                i--;
+            if (i < 0 || ByteSwap32(phash[i][j]) < ptarget[i])
+            {
+                nNonceRet = nNonce + n + j;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+template<typename V, int N>
+static SHA256_INLINE void SHA256D64Lanes(unsigned char* pout, const unsigned char* pin, unsigned int nBlocks)
+{
+    // nBlocks must be a multiple of N
+    const V zero = V();
+    for (unsigned int n = 0; n < nBlocks; n += N)
+    {
+        V W[16];
+        V state[8];
+        for (int i = 0; i < 16; i++)
+        {
+            unsigned int pw[N];
+            for (int j = 0; j < N; j++)
+                pw[j] = ReadBE32(pin + 64 * (n + j) + 4 * i);
+            memcpy(&W[i], pw, sizeof(V));
+        }
+        for (int i = 0; i < 8; i++)
+            state[i] = zero + pSHA256InitState[i];
+        TransformLanes(state, W);
+
+        // Padding block of a 64 byte message
+        W[0] = zero + 0x80000000;
+        for (int i = 1; i < 15; i++)
+            W[i] = zero;
+        W[15] = zero + 64 * 8;
+        TransformLanes(state, W);
+
+        // Hash the 32 byte result again
+        for (int i = 0; i < 8; i++)
+        {
+            W[i] = state[i];
+            state[i] = zero + pSHA256InitState[i];
+        }
+        W[8] = zero + 0x80000000;
+        for (int i = 9; i < 15; i++)
+            W[i] = zero;
+        W[15] = zero + 32 * 8;
+        TransformLanes(state, W);
+
+        unsigned int phash[8][N];
+        memcpy(phash, state, sizeof(phash));
+        for (int j = 0; j < N; j++)
+            for (int i = 0; i < 8; i++)
+                WriteBE32(pout + 32 * (n + j) + 4 * i, phash[i][j]);
+    }
+}
+
+#undef ROTR
+#undef Ch
+#undef Maj
+#undef S0
+#undef S1
+#undef s0
+#undef s1
+
+
+
+static bool ScanHash_Generic(const unsigned int* pmidstate, const void* pdata, const unsigned int* ptarget,
+                             unsigned int nNonce, unsigned int nCount, unsigned int& nNonceRet)
+{
+    return ScanHashLanes<unsigned int, 1>(pmidstate, pdata, ptarget, nNonce, nCount, nNonceRet);
+}
+
+#ifdef USE_SIMD_SHA256
+typedef unsigned int v4si __attribute__((vector_size(16)));
+typedef unsigned int v8si __attribute__((vector_size(32)));
+
+__attribute__((target("sse2")))
+static bool ScanHash_4WaySSE2(const unsigned int* pmidstate, const void* pdata, const unsigned int* ptarget,
+                              unsigned int nNonce, unsigned int nCount, unsigned int& nNonceRet)
+{
+    return ScanHashLanes<v4si, 4>(pmidstate, pdata, ptarget, nNonce, nCount, nNonceRet);
+}
+
+__attribute__((target("avx2")))
+static bool ScanHash_8WayAVX2(const unsigned int* pmidstate, const void* pdata, const unsigned int* ptarget,
+                              unsigned int nNonce, unsigned int nCount, unsigned int& nNonceRet)
+{
+    return ScanHashLanes<v8si, 8>(pmidstate, pdata, ptarget, nNonce, nCount, nNonceRet);
+}
+
+__attribute__((target("sse2")))
+static void SHA256D64_4WaySSE2(unsigned char* pout, const unsigned char* pin, unsigned int nBlocks)
+{
+    SHA256D64Lanes<v4si, 4>(pout, pin, nBlocks);
+}
+
+__attribute__((target("avx2")))
+static void SHA256D64_8WayAVX2(unsigned char* pout, const unsigned char* pin, unsigned int nBlocks)
+{
+    SHA256D64Lanes<v8si, 8>(pout, pin, nBlocks);
+}
+
+static bool HasAVX2()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    // The OS has to save the ymm registers for us, check OSXSAVE and XCR0
+    if (!(ecx & (1 << 27)) || !(ecx & (1 << 28)))
+        return false;
+    unsigned int xcr0, xcr0hi;
+    __asm__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0hi) : "c" (0));
+    if ((xcr0 & 6) != 6)
+        return false;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 5)) != 0;
+}
+
+static bool HasSSE2()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (edx & (1 << 26)) != 0;
+}
+#endif
+
+
+
+typedef bool (*ScanHashFn)(const unsigned int*, const void*, const unsigned int*, unsigned int, unsigned int, unsigned int&);
+
+struct CScanHashImpl
+{
+    ScanHashFn pfn;
+    const char* pszName;
+
+    CScanHashImpl()
+    {
+        pfn = ScanHash_Generic;
+        pszName = "generic";
+#ifdef USE_SIMD_SHA256
+        if (HasAVX2())
+        {
+            pfn = ScanHash_8WayAVX2;
+            pszName = "8-way AVX2";
+        }
+        else if (HasSSE2())
+        {
+            pfn = ScanHash_4WaySSE2;
+            pszName = "4-way SSE2";
+        }
+#endif
+    }
+};
+
+// Chosen once during static initialization
+static CScanHashImpl scanhashimpl;
+
+bool ScanHash(const unsigned int* pmidstate, const void* pdata, const unsigned int* ptarget,
+              unsigned int nNonce, unsigned int nCount, unsigned int& nNonceRet)
+{
+    return scanhashimpl.pfn(pmidstate, pdata, ptarget, nNonce, nCount, nNonceRet);
+}
+
+const char* ScanHashName()
+{
+    return scanhashimpl.pszName;
+}
+
+
+
+//
+// Double SHA-256 of 64 byte inputs
+//
+
+static void SHA256D64_Transform(unsigned char* pout, const unsigned char* pin, unsigned int nBlocks)
+{
+    // One input at a time through the single-buffer transform
+    unsigned char pchPad64[64] = {0x80};
+    pchPad64[62] = (64 * 8) >> 8;
+    unsigned char pchBlock[64] = {0};
+    pchBlock[32] = 0x80;
+    pchBlock[62] = (32 * 8) >> 8;
+
+    for (unsigned int n = 0; n < nBlocks; n++)
+    {
+        unsigned int pstate[8];
+        memcpy(pstate, pSHA256InitState, sizeof(pstate));
+        pTransform(pstate, pin + 64 * n, 1);
+        pTransform(pstate, pchPad64, 1);
+        for (int i = 0; i < 8; i++)
+            WriteBE32(pchBlock + 4 * i, pstate[i]);
+        memcpy(pstate, pSHA256InitState, sizeof(pstate));
+        pTransform(pstate, pchBlock, 1);
+        for (int i = 0; i < 8; i++)
+            WriteBE32(pout + 32 * n + 4 * i, pstate[i]);
+    }
+}
+
+typedef void (*SHA256D64Fn)(unsigned char*, const unsigned char*, unsigned int);
+
+struct CSHA256D64Impl
+{
+    SHA256D64Fn pfn;
+    unsigned int nLanes;
+
+    CSHA256D64Impl()
+    {
+        pfn = NULL;
+        nLanes = 1;
+#ifdef USE_SIMD_SHA256
+        if (HasAVX2())
+        {
+            pfn = SHA256D64_8WayAVX2;
+            nLanes = 8;
+        }
+        else if (HasSSE2())
+        {
+            pfn = SHA256D64_4WaySSE2;
+            nLanes = 4;
+        }
+#endif
+    }
+};
+
+static CSHA256D64Impl sha256d64impl;
+
+void SHA256D64(unsigned char* pout, const unsigned char* pin, unsigned int nBlocks)
+{
+    // Whole groups of lanes in the multi-buffer kernel, the rest one by one
+    unsigned int nMulti = 0;
+    if (sha256d64impl.pfn)
+    {
+        nMulti = nBlocks - nBlocks % sha256d64impl.nLanes;
+        if (nMulti > 0)
+            sha256d64impl.pfn(pout, pin, nMulti);
+    }
+    SHA256D64_Transform(pout + 32 * nMulti, pin + 64 * nMulti, nBlocks - nMulti);
+}
@@ -0,0 +1,63 @@
+// Copyright (c) 2009 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(_MSC_VER) || defined(__BORLANDC__)
+typedef unsigned __int64 sha256_uint64;
+#else
+typedef unsigned long long sha256_uint64;
+#endif
+
+
+//
+// Single-buffer SHA-256 used by Hash(), Hash160() and BlockSHA256.  The
+// compression function runs on the SHA extensions (SHA-NI) if the CPU has
+// them and SHA256AutoDetect() has checked them against OpenSSL's transform,
+// otherwise on OpenSSL's transform as before.
+//
+class CSHA256
+{
+private:
+    unsigned int pstate[8];
+    unsigned char pchBuf[64];
+    sha256_uint64 nBytes;
+
+public:
+    CSHA256()
+    {
+        Reset();
+    }
+
+    CSHA256& Reset();
+    CSHA256& Write(const unsigned char* pch, size_t nLen);
+    void Finalize(unsigned char* pchHash);
+};
+
+// Runs nBlocks 64-byte blocks of big-endian input through the compression function
+void SHA256Transform(unsigned int* pstate, const void* pin, unsigned int nBlocks);
+
+// Picks the fastest transform that passes the self-test, returns its name
+const char* SHA256AutoDetect();
+bool SHA256SelfTest();
+
+// Double SHA-256 of nBlocks consecutive 64 byte inputs, such as the pairs
+// on a level of a merkle tree, into nBlocks consecutive 32 byte outputs.
+// Several inputs are hashed side by side in SIMD lanes when the CPU can.
+void SHA256D64(unsigned char* pout, const unsigned char* pin, unsigned int nBlocks);
+
+
+//
+// Nonce scanning for the miner.  Consecutive nonces are double-SHA256'd
+// side by side in SIMD lanes, 8 at a time with AVX2 or 4 at a time with SSE2.
+// The kernel is picked once at startup from CPUID, with a plain C++ version
+// for CPUs and compilers that have neither.
+//
+// pmidstate is the SHA-256 state after the first 64 bytes of the header,
+// pdata points to the remaining 16 bytes (the end of hashMerkleRoot, nTime,
+// nBits and nNonce, whose nNonce is ignored) and ptarget is the uint256
+// target as 8 little-endian words.  Returns true and sets nNonceRet to the
+// first nonce in [nNonce, nNonce + nCount) whose hash is <= target.
+//
+bool ScanHash(const unsigned int* pmidstate, const void* pdata, const unsigned int* ptarget,
+              unsigned int nNonce, unsigned int nCount, unsigned int& nNonceRet);
+const char* ScanHashName();
@@ -3442,6 +3442,12 @@ bool CMyApp::OnInit2()
             "  -proxy=<ip:port>\t  Connect through socks4 proxy\n"
             "  -addnode=<ip>\t  Add a node to connect to\n"
             "  -connect=<ip>\t  Connect only to the specified node\n"
+            "  -workserver[=<port>]\t  Serve work to local mining processes\n"
+            "  -maxsigcachesize=<n>\t  Number of verified signatures to remember, about 80 bytes each (default 50000, 0 = off)\n"
+            "  -maxpubkeycachesize=<n>\t  Decoded public keys to remember (default 10000)\n"
+            "  -dbcache=<n>\t  Megabytes of transaction index to keep in memory (default 25, 0 = off)\n"
+            "  -utxo\t\t  Keep a database of unspent outputs (new block index only)\n"
+            "  -benchreorg=<n>\t  Time disconnecting and reconnecting up to n blocks, then exit\n"
             "  -?\t\t  This help message\n";
         wxMessageBox(strUsage, "Bitcoin", wxOK);
         return false;
@@ -3458,6 +3464,8 @@ bool CMyApp::OnInit2()
 
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     printf("Bitcoin version %d, OS version %s\n", VERSION, wxGetOsDescription().mb_str());
+    printf("Using %s SHA-256\n", SHA256AutoDetect());
+    printf("Using %s ECDSA verification\n", Secp256k1AutoDetect());
 
     if (mapArgs.count("-loadblockindextest"))
     {
@@ -3571,6 +3579,12 @@ bool CMyApp::OnInit2()
         return false;
     }
 
+    if (mapArgs.count("-benchreorg"))
+    {
+        BenchReorganize(atoi(mapArgs["-benchreorg"]));
+        return false;
+    }
+
     if (mapArgs.count("-printblock"))
     {
         string strMatch = mapArgs["-printblock"];
@@ -3645,6 +3659,13 @@ bool CMyApp::OnInit2()
     if (!StartNode(strErrors))
         wxMessageBox(strErrors, "Bitcoin");
 
+    if (mapArgs.count("-workserver"))
+    {
+        int nPort = atoi(mapArgs["-workserver"].c_str());
+        if (!StartWorkServer(strErrors, nPort > 0 ? nPort : DEFAULT_WORKSERVER_PORT))
+            wxMessageBox(strErrors, "Bitcoin");
+    }
+
     GenerateBitcoins(fGenerateBitcoins);
 
     if (fFirstRun)
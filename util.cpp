@@ -584,3 +584,172 @@ void AddTimeData(unsigned int ip, int64 nTime)
         printf("|  nTimeOffset = %+"PRI64d"  (%+"PRI64d" minutes)\n", nTimeOffset, nTimeOffset/60);
     }
 }
+
+
+
+
+
+
+
+
+//
+// Splits [0, nCount) into chunks of nChunk and runs pfn on each chunk, on a
+// small pool of helper threads plus the calling thread.  The helpers are
+// started on first use and sleep on a semaphore between calls.  Only one
+// loop runs on the pool at a time, a ParallelFor started while another is
+// running (including from inside pfn) just runs inline on its own thread.
+// An exception in pfn on a helper stops the loop and is thrown again from
+// ParallelFor on the calling thread.
+//
+static CCriticalSection cs_ParallelFor;
+static bool fParallelRunning = false;
+static int nParallelHelpers = -1;
+static wxSemaphore* psemParallelStart = NULL;
+static wxSemaphore* psemParallelDone = NULL;
+static void (*pfnParallel)(void*, int, int) = NULL;
+static void* pargParallel = NULL;
+static int nParallelCount = 0;
+static int nParallelChunk = 0;
+static int nParallelNext = 0;
+static bool fParallelException = false;
+static string strParallelException;
+
+static void RunParallelChunks()
+{
+    loop
+    {
+        int nBegin;
+        CRITICAL_BLOCK(cs_ParallelFor)
+        {
+            nBegin = nParallelNext;
+            nParallelNext += nParallelChunk;
+        }
+        if (nBegin >= nParallelCount)
+            return;
+        pfnParallel(pargParallel, nBegin, min(nBegin + nParallelChunk, nParallelCount));
+    }
+}
+
+static void SetParallelException(const char* pszWhat)
+{
+    // Hand out no more chunks, ParallelFor throws once the helpers are done
+    CRITICAL_BLOCK(cs_ParallelFor)
+    {
+        if (!fParallelException)
+            strParallelException = pszWhat;
+        fParallelException = true;
+        nParallelNext = nParallelCount;
+    }
+}
+
+void ThreadParallelFor(void* parg)
+{
+    loop
+    {
+        psemParallelStart->Wait();
+        try
+        {
+            RunParallelChunks();
+        }
+        catch (std::exception& e) {
+            LogException(&e, "ThreadParallelFor()");
+            SetParallelException(e.what());
+        } catch (...) {
+            LogException(NULL, "ThreadParallelFor()");
+            SetParallelException("unknown exception");
+        }
+        psemParallelDone->Post();
+    }
+}
+
+int GetParallelThreads()
+{
+    CRITICAL_BLOCK(cs_ParallelFor)
+    {
+        if (nParallelHelpers < 0)
+        {
+            int nProcessors = wxThread::GetCPUCount();
+            if (nProcessors < 1)
+                nProcessors = 1;
+            if (nProcessors > 16)
+                nProcessors = 16;
+            nParallelHelpers = 0;
+            psemParallelStart = new wxSemaphore();
+            psemParallelDone = new wxSemaphore();
+            for (int i = 0; i < nProcessors - 1; i++)
+            {
+                if (_beginthread(ThreadParallelFor, 0, NULL) == -1)
+                    break;
+                nParallelHelpers++;
+            }
+            printf("ParallelFor using %d threads\n", nParallelHelpers + 1);
+        }
+    }
+    return nParallelHelpers + 1;
+}
+
+void ParallelFor(void (*pfn)(void* parg, int nBegin, int nEnd), void* parg, int nCount, int nChunk)
+{
+    if (nCount <= 0)
+        return;
+    if (nChunk < 1)
+        nChunk = 1;
+
+    bool fInline = (nCount <= nChunk || GetParallelThreads() == 1);
+    if (!fInline)
+    {
+        CRITICAL_BLOCK(cs_ParallelFor)
+        {
+            if (fParallelRunning)
+            {
+                fInline = true;
+            }
+            else
+            {
+                fParallelRunning = true;
+                pfnParallel = pfn;
+                pargParallel = parg;
+                nParallelCount = nCount;
+                nParallelChunk = nChunk;
+                nParallelNext = 0;
+                fParallelException = false;
+                strParallelException.clear();
+            }
+        }
+    }
+    if (fInline)
+    {
+        for (int nBegin = 0; nBegin < nCount; nBegin += nChunk)
+            pfn(parg, nBegin, min(nBegin + nChunk, nCount));
+        return;
+    }
+
+    // Wake only as many helpers as there are chunks left after ours
+    int nWake = min(nParallelHelpers, (nCount - 1) / nChunk);
+    for (int i = 0; i < nWake; i++)
+        psemParallelStart->Post();
+    try
+    {
+        RunParallelChunks();
+    }
+    catch (...)
+    {
+        for (int i = 0; i < nWake; i++)
+            psemParallelDone->Wait();
+        CRITICAL_BLOCK(cs_ParallelFor)
+            fParallelRunning = false;
+        throw;
+    }
+    for (int i = 0; i < nWake; i++)
+        psemParallelDone->Wait();
+    bool fException;
+    string strException;
+    CRITICAL_BLOCK(cs_ParallelFor)
+    {
+        fParallelRunning = false;
+        fException = fParallelException;
+        strException = strParallelException;
+    }
+    if (fException)
+        throw runtime_error(string("ParallelFor() : ") + strException);
+}
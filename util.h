@@ -150,6 +150,8 @@ uint64 GetRand(uint64 nMax);
 int64 GetTime();
 int64 GetAdjustedTime();
 void AddTimeData(unsigned int ip, int64 nTime);
+int GetParallelThreads();
+void ParallelFor(void (*pfn)(void* parg, int nBegin, int nEnd), void* parg, int nCount, int nChunk);
 
 
 
@@ -511,9 +513,9 @@ template<typename T1>
 inline uint256 Hash(const T1 pbegin, const T1 pend)
 {
     uint256 hash1;
-    SHA256((unsigned char*)&pbegin[0], (pend - pbegin) * sizeof(pbegin[0]), (unsigned char*)&hash1);
+    CSHA256().Write((unsigned char*)&pbegin[0], (pend - pbegin) * sizeof(pbegin[0])).Finalize((unsigned char*)&hash1);
     uint256 hash2;
-    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    CSHA256().Write((unsigned char*)&hash1, sizeof(hash1)).Finalize((unsigned char*)&hash2);
     return hash2;
 }
 
@@ -522,13 +524,12 @@ inline uint256 Hash(const T1 p1begin, const T1 p1end,
                     const T2 p2begin, const T2 p2end)
 {
     uint256 hash1;
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, (unsigned char*)&p1begin[0], (p1end - p1begin) * sizeof(p1begin[0]));
-    SHA256_Update(&ctx, (unsigned char*)&p2begin[0], (p2end - p2begin) * sizeof(p2begin[0]));
-    SHA256_Final((unsigned char*)&hash1, &ctx);
+    CSHA256()
+        .Write((unsigned char*)&p1begin[0], (p1end - p1begin) * sizeof(p1begin[0]))
+        .Write((unsigned char*)&p2begin[0], (p2end - p2begin) * sizeof(p2begin[0]))
+        .Finalize((unsigned char*)&hash1);
     uint256 hash2;
-    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    CSHA256().Write((unsigned char*)&hash1, sizeof(hash1)).Finalize((unsigned char*)&hash2);
     return hash2;
 }
 
@@ -538,17 +539,56 @@ inline uint256 Hash(const T1 p1begin, const T1 p1end,
                     const T3 p3begin, const T3 p3end)
 {
     uint256 hash1;
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, (unsigned char*)&p1begin[0], (p1end - p1begin) * sizeof(p1begin[0]));
-    SHA256_Update(&ctx, (unsigned char*)&p2begin[0], (p2end - p2begin) * sizeof(p2begin[0]));
-    SHA256_Update(&ctx, (unsigned char*)&p3begin[0], (p3end - p3begin) * sizeof(p3begin[0]));
-    SHA256_Final((unsigned char*)&hash1, &ctx);
+    CSHA256()
+        .Write((unsigned char*)&p1begin[0], (p1end - p1begin) * sizeof(p1begin[0]))
+        .Write((unsigned char*)&p2begin[0], (p2end - p2begin) * sizeof(p2begin[0]))
+        .Write((unsigned char*)&p3begin[0], (p3end - p3begin) * sizeof(p3begin[0]))
+        .Finalize((unsigned char*)&hash1);
     uint256 hash2;
-    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    CSHA256().Write((unsigned char*)&hash1, sizeof(hash1)).Finalize((unsigned char*)&hash2);
     return hash2;
 }
 
+//
+// Stream that feeds whatever is serialized to it straight into SHA-256,
+// so hashing an object doesn't need to allocate a buffer for it
+//
+class CHashWriter
+{
+private:
+    CSHA256 ctx;
+
+public:
+    int nType;
+    int nVersion;
+
+    CHashWriter(int nTypeIn=SER_GETHASH, int nVersionIn=VERSION) : nType(nTypeIn), nVersion(nVersionIn) { }
+
+    CHashWriter& write(const char* pch, int nSize)
+    {
+        ctx.Write((const unsigned char*)pch, nSize);
+        return (*this);
+    }
+
+    // Double SHA-256 of everything written, same as Hash() over the bytes
+    uint256 GetHash()
+    {
+        uint256 hash1;
+        ctx.Finalize((unsigned char*)&hash1);
+        uint256 hash2;
+        CSHA256().Write((unsigned char*)&hash1, sizeof(hash1)).Finalize((unsigned char*)&hash2);
+        return hash2;
+    }
+
+    template<typename T>
+    CHashWriter& operator<<(const T& obj)
+    {
+        // Serialize to this stream
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 /*
     @up4dev
     获取对象序列化后的HASH
@@ -556,13 +596,9 @@ inline uint256 Hash(const T1 p1begin, const T1 p1end,
 template<typename T>
 uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=VERSION)
 {
-    // Most of the time is spent allocating and deallocating CDataStream's
-    // buffer.  If this ever needs to be optimized further, make a CStaticStream
-    // class with its buffer on the stack.
-    CDataStream ss(nType, nVersion);
-    ss.reserve(10000);
+    CHashWriter ss(nType, nVersion);
     ss << obj;
-    return Hash(ss.begin(), ss.end());
+    return ss.GetHash();
 }
 
 /*
@@ -573,7 +609,7 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=VERSION)
 inline uint160 Hash160(const vector<unsigned char>& vch)
 {
     uint256 hash1;
-    SHA256(&vch[0], vch.size(), (unsigned char*)&hash1);
+    CSHA256().Write(&vch[0], vch.size()).Finalize((unsigned char*)&hash1);
     uint160 hash2;
     RIPEMD160((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
     return hash2;
@@ -0,0 +1,172 @@
+// Copyright (c) 2009 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/sha.h>
+using namespace std;
+
+
+//
+// Stub worker for the local work server (see workserver.cpp).  Asks for
+// work, hashes the header over a range of nonces and submits the nonce that
+// gave the lowest hash, whether or not it meets the target, so every round
+// exercises getwork and submit.  Only plain sockets and OpenSSL are used,
+// so it doesn't need anything from the client to build.
+//
+//   worker [-port=<n>] [-count=<n>] [-nonces=<n>]
+//
+// -count is how many rounds to do (default 1, 0 = forever) and -nonces how
+// many nonces to try each round (default 1000000).
+//
+
+static bool SendLine(int hSocket, const string& str)
+{
+    const char* psz = str.c_str();
+    const char* pszEnd = psz + str.size();
+    while (psz < pszEnd)
+    {
+        int ret = send(hSocket, psz, pszEnd - psz, 0);
+        if (ret <= 0)
+            return false;
+        psz += ret;
+    }
+    return true;
+}
+
+static bool RecvLine(int hSocket, string& strLine)
+{
+    strLine.clear();
+    char c;
+    while (recv(hSocket, &c, 1, 0) == 1)
+    {
+        if (c == '\n')
+            return true;
+        if (c != '\r')
+            strLine += c;
+    }
+    return false;
+}
+
+static bool ParseHex(const string& str, vector<unsigned char>& vch)
+{
+    vch.clear();
+    if (str.size() % 2 != 0)
+        return false;
+    for (int i = 0; i < str.size(); i += 2)
+    {
+        unsigned int n;
+        if (sscanf(str.substr(i, 2).c_str(), "%02x", &n) != 1)
+            return false;
+        vch.push_back(n);
+    }
+    return true;
+}
+
+// Compares 32 byte little-endian numbers
+static bool LessThan(const unsigned char* a, const unsigned char* b)
+{
+    for (int i = 31; i >= 0; i--)
+        if (a[i] != b[i])
+            return a[i] < b[i];
+    return false;
+}
+
+int main(int argc, char* argv[])
+{
+    int nPort = 8332;
+    int nCount = 1;
+    unsigned int nNonces = 1000000;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "-port=", 6) == 0)
+            nPort = atoi(argv[i] + 6);
+        else if (strncmp(argv[i], "-count=", 7) == 0)
+            nCount = atoi(argv[i] + 7);
+        else if (strncmp(argv[i], "-nonces=", 8) == 0)
+            nNonces = strtoul(argv[i] + 8, NULL, 10);
+        else
+        {
+            printf("usage: worker [-port=<n>] [-count=<n>] [-nonces=<n>]\n");
+            return 1;
+        }
+    }
+
+    int hSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sockaddr.sin_port = htons(nPort);
+    if (hSocket < 0 || connect(hSocket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) != 0)
+    {
+        printf("Couldn't connect to the work server on port %d\n", nPort);
+        return 1;
+    }
+
+    for (int nRound = 0; nCount == 0 || nRound < nCount; nRound++)
+    {
+        // work <id> <header> <midstate> <target>
+        string strLine;
+        if (!SendLine(hSocket, "getwork\n") || !RecvLine(hSocket, strLine))
+        {
+            printf("Lost the connection to the work server\n");
+            return 1;
+        }
+        char pszId[32], pszHeader[200], pszMidstate[100], pszTarget[100];
+        vector<unsigned char> vchHeader, vchTarget;
+        if (sscanf(strLine.c_str(), "work %31s %199s %99s %99s", pszId, pszHeader, pszMidstate, pszTarget) != 4 ||
+            !ParseHex(pszHeader, vchHeader) || vchHeader.size() != 80 ||
+            !ParseHex(string(64 - min(strlen(pszTarget), (size_t)64), '0') + pszTarget, vchTarget))
+        {
+            printf("Bad reply to getwork: %s\n", strLine.c_str());
+            return 1;
+        }
+
+        // The target is a big-endian hex number, the hash is compared little-endian
+        unsigned char pchTarget[32];
+        for (int i = 0; i < 32; i++)
+            pchTarget[i] = vchTarget[31 - i];
+
+        unsigned char pchBest[32];
+        memset(pchBest, 0xff, sizeof(pchBest));
+        unsigned int nBestNonce = 0;
+        unsigned int nNonce = 0;
+        for (; nNonce < nNonces; nNonce++)
+        {
+            for (int i = 0; i < 4; i++)
+                vchHeader[76 + i] = (nNonce >> (8 * i)) & 0xff;
+            unsigned char pchHash1[32];
+            unsigned char pchHash[32];
+            SHA256(&vchHeader[0], 80, pchHash1);
+            SHA256(pchHash1, 32, pchHash);
+            if (LessThan(pchHash, pchBest))
+            {
+                memcpy(pchBest, pchHash, sizeof(pchBest));
+                nBestNonce = nNonce;
+            }
+            if (!LessThan(pchTarget, pchHash))
+                break;
+        }
+
+        char pszSubmit[100];
+        sprintf(pszSubmit, "submit %s %x\n", pszId, nBestNonce);
+        if (!SendLine(hSocket, pszSubmit) || !RecvLine(hSocket, strLine))
+        {
+            printf("Lost the connection to the work server\n");
+            return 1;
+        }
+        printf("work %s: %u nonces, best %x, %s\n", pszId, min(nNonce + 1, nNonces), nBestNonce, strLine.c_str());
+    }
+
+    close(hSocket);
+    return 0;
+}
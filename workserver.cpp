@@ -0,0 +1,416 @@
+// Copyright (c) 2009 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+#include "headers.h"
+#include "sha.h"
+
+void ThreadWorkServer2(void* parg);
+
+SOCKET hWorkListenSocket = INVALID_SOCKET;
+
+
+
+//
+// Hands out block headers to worker processes on this computer and takes
+// back the nonces they find, so hashing can be done outside the client.
+// Each request and reply is one line:
+//
+//   getwork
+//     -> work <id> <header> <midstate> <target>
+//   submit <id> <nonce>
+//     -> accepted | rejected | stale | unknown
+//
+// <header> is the 80 byte block header in hex, in the byte order it is
+// hashed in, with a zero nonce.  <midstate> is the SHA-256 state after the
+// first 64 bytes of the header as 8 little-endian words in hex.  <target>
+// is the hash target as a hex number like uint256::GetHex, and <nonce> is
+// a hex number.  Workers get distinct extranonces from the same counter as
+// the built-in miner, so nobody hashes the same header twice.
+//
+// worker.cpp is a stub worker for trying the server out.
+//
+
+class CWorkTemplate
+{
+public:
+    CBlock block;
+    CBlockIndex* pindexPrev;
+    CKey key;
+    vector<uint256> vMerkleBranch;
+
+    CWorkTemplate()
+    {
+        pindexPrev = NULL;
+    }
+};
+
+// Only ThreadWorkServer touches these
+static map<int, CWorkTemplate> mapWorkTemplates;
+static map<unsigned int, pair<int, CBlock> > mapWork;
+static int nWorkTemplate = 0;
+static unsigned int nWorkTemplateTransactionsUpdated = 0;
+static int64 nWorkTemplateTime = 0;
+static unsigned int nWorkId = 0;
+
+
+bool GetWork(unsigned int& nIdRet, CBlock& blockRet)
+{
+    // The template is copied from the miner's only when the best block
+    // changes, or every minute if there are new transactions
+    map<int, CWorkTemplate>::iterator mi = mapWorkTemplates.find(nWorkTemplate);
+    if (mi == mapWorkTemplates.end() || (*mi).second.pindexPrev != pindexBest ||
+        (nTransactionsUpdated != nWorkTemplateTransactionsUpdated && GetTime() - nWorkTemplateTime > 60))
+    {
+        CWorkTemplate worktemplate;
+        unsigned int nTransactionsUpdatedLast;
+        if (!GetMinerWork(worktemplate.block, worktemplate.pindexPrev, nTransactionsUpdatedLast, worktemplate.key, worktemplate.vMerkleBranch))
+            return false;
+
+        // Work on top of an older block is no use any more
+        if (mi != mapWorkTemplates.end() && (*mi).second.pindexPrev != worktemplate.pindexPrev)
+        {
+            mapWorkTemplates.clear();
+            mapWork.clear();
+        }
+
+        mapWorkTemplates[++nWorkTemplate] = worktemplate;
+        nWorkTemplateTransactionsUpdated = nTransactionsUpdatedLast;
+        nWorkTemplateTime = GetTime();
+        mi = mapWorkTemplates.find(nWorkTemplate);
+    }
+    const CWorkTemplate& worktemplate = (*mi).second;
+
+    // The work only needs the header and the coinbase, the rest of the
+    // block is put back from the template when a nonce comes in
+    CBlock& block = blockRet;
+    block.SetNull();
+    block.nVersion = worktemplate.block.nVersion;
+    block.hashPrevBlock = worktemplate.block.hashPrevBlock;
+    block.nBits = worktemplate.block.nBits;
+    block.vtx.push_back(worktemplate.block.vtx[0]);
+    IncrementMinerExtraNonce(block, worktemplate.vMerkleBranch);
+    block.nTime = max(worktemplate.pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
+    block.nNonce = 0;
+
+    nIdRet = ++nWorkId;
+    mapWork[nIdRet] = make_pair(nWorkTemplate, block);
+
+    // Forget the oldest work if workers don't come back with it
+    while (mapWork.size() > 10000)
+        mapWork.erase(mapWork.begin());
+    return true;
+}
+
+string SubmitWork(unsigned int nId, unsigned int nNonce)
+{
+    map<unsigned int, pair<int, CBlock> >::iterator mi = mapWork.find(nId);
+    if (mi == mapWork.end())
+        return "unknown";
+    const CWorkTemplate& worktemplate = mapWorkTemplates[(*mi).second.first];
+    const CBlock& work = (*mi).second.second;
+
+    auto_ptr<CBlock> pblock(new CBlock(worktemplate.block));
+    if (!pblock.get())
+        return "rejected";
+    pblock->vtx[0] = work.vtx[0];
+    pblock->vMerkleTree.clear();
+    pblock->hashMerkleRoot = work.hashMerkleRoot;
+    pblock->nTime = work.nTime;
+    pblock->nNonce = nNonce;
+
+    uint256 hash = pblock->GetHash();
+    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    if (hash > hashTarget)
+        return "rejected";
+
+    //// debug print
+    printf("WorkServer: proof-of-work found  hash: %s  target: %s\n", hash.GetHex().c_str(), hashTarget.GetHex().c_str());
+
+    RotateMinerKey(worktemplate.key);
+    CRITICAL_BLOCK(cs_main)
+    {
+        if (worktemplate.pindexPrev != pindexBest)
+            return "stale";
+
+        // Save key
+        if (!AddKey(worktemplate.key))
+            return "rejected";
+
+        // Process this block the same as if we had received it from another node
+        if (!ProcessBlock(NULL, pblock.release()))
+        {
+            printf("ERROR in WorkServer, ProcessBlock, block not accepted\n");
+            return "rejected";
+        }
+    }
+    return "accepted";
+}
+
+string HandleWorkRequest(const string& strLine)
+{
+    vector<string> vWords;
+    ParseString(strLine, ' ', vWords);
+    if (vWords.empty())
+        return "";
+
+    if (vWords[0] == "getwork")
+    {
+        unsigned int nId;
+        CBlock block;
+        if (!GetWork(nId, block))
+            return "error\n";
+
+        unsigned int pmidstate[8];
+        CryptoPP::SHA256::InitState(pmidstate);
+        SHA256Transform(pmidstate, BEGIN(block.nVersion), 1);
+
+        uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
+        return strprintf("work %u %s %s %s\n", nId,
+                         HexStr(BEGIN(block.nVersion), END(block.nNonce), false).c_str(),
+                         HexStr(BEGIN(pmidstate), END(pmidstate), false).c_str(),
+                         hashTarget.GetHex().c_str());
+    }
+    else if (vWords[0] == "submit" && vWords.size() == 3)
+    {
+        unsigned int nId = strtoul(vWords[1].c_str(), NULL, 10);
+        unsigned int nNonce = strtoul(vWords[2].c_str(), NULL, 16);
+        return SubmitWork(nId, nNonce) + "\n";
+    }
+    return "error\n";
+}
+
+
+
+
+
+
+static bool Send(SOCKET hSocket, const string& str)
+{
+    // Replies are short, a worker that stops reading long enough to fill
+    // its socket buffer gets dropped rather than holding up the others
+    const char* psz = str.c_str();
+    const char* pszEnd = psz + str.size();
+    int64 nStart = GetTimeMillis();
+    while (psz < pszEnd)
+    {
+        int ret = send(hSocket, psz, pszEnd - psz, MSG_NOSIGNAL);
+        if (ret < 0)
+        {
+            if (WSAGetLastError() != WSAEWOULDBLOCK || GetTimeMillis() - nStart > 1000)
+                return false;
+            Sleep(10);
+            continue;
+        }
+        psz += ret;
+    }
+    return true;
+}
+
+bool StartWorkServer(string& strError, unsigned short nPort)
+{
+    strError = "";
+    int nOne = 1;
+
+    hWorkListenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (hWorkListenSocket == INVALID_SOCKET)
+    {
+        strError = strprintf("Error: Couldn't open socket for the work server (socket returned error %d)", WSAGetLastError());
+        printf("%s\n", strError.c_str());
+        return false;
+    }
+
+#ifndef __WXMSW__
+    setsockopt(hWorkListenSocket, SOL_SOCKET, SO_REUSEADDR, (void*)&nOne, sizeof(int));
+#endif
+
+#ifdef __WXMSW__
+    // Set to nonblocking, accepted sockets are set separately since they
+    // don't inherit it everywhere
+    if (ioctlsocket(hWorkListenSocket, FIONBIO, (u_long*)&nOne) == SOCKET_ERROR)
+#else
+    if (fcntl(hWorkListenSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR)
+#endif
+    {
+        strError = strprintf("Error: Couldn't set properties on the work server socket (error %d)", WSAGetLastError());
+        printf("%s\n", strError.c_str());
+        return false;
+    }
+
+    // Workers are local processes, so only listen on the loopback address
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sockaddr.sin_port = htons(nPort);
+    if (::bind(hWorkListenSocket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == SOCKET_ERROR)
+    {
+        strError = strprintf("Error: Unable to bind the work server to port %d on this computer (bind returned error %d)", nPort, WSAGetLastError());
+        printf("%s\n", strError.c_str());
+        return false;
+    }
+
+    if (listen(hWorkListenSocket, SOMAXCONN) == SOCKET_ERROR)
+    {
+        strError = strprintf("Error: Listening for workers failed (listen returned error %d)", WSAGetLastError());
+        printf("%s\n", strError.c_str());
+        return false;
+    }
+    printf("Work server listening on port %d\n", nPort);
+
+    if (_beginthread(ThreadWorkServer, 0, NULL) == -1)
+    {
+        strError = "Error: _beginthread(ThreadWorkServer) failed";
+        printf("%s\n", strError.c_str());
+        return false;
+    }
+    return true;
+}
+
+void ThreadWorkServer(void* parg)
+{
+    IMPLEMENT_RANDOMIZE_STACK(ThreadWorkServer(parg));
+
+    try
+    {
+        vnThreadsRunning[4]++;
+        ThreadWorkServer2(parg);
+        vnThreadsRunning[4]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[4]--;
+        PrintException(&e, "ThreadWorkServer()");
+    } catch (...) {
+        vnThreadsRunning[4]--;
+        PrintException(NULL, "ThreadWorkServer()");
+    }
+
+    printf("ThreadWorkServer exiting\n");
+}
+
+void ThreadWorkServer2(void* parg)
+{
+    printf("ThreadWorkServer started\n");
+    map<SOCKET, string> mapClients;
+
+    while (!fShutdown)
+    {
+        struct timeval timeout;
+        timeout.tv_sec  = 0;
+        timeout.tv_usec = 50000;
+
+        fd_set fdsetRecv;
+        FD_ZERO(&fdsetRecv);
+        SOCKET hSocketMax = hWorkListenSocket;
+        FD_SET(hWorkListenSocket, &fdsetRecv);
+        for (map<SOCKET, string>::iterator mi = mapClients.begin(); mi != mapClients.end(); ++mi)
+        {
+            FD_SET((*mi).first, &fdsetRecv);
+            hSocketMax = max(hSocketMax, (*mi).first);
+        }
+
+        vnThreadsRunning[4]--;
+        int nSelect = select(hSocketMax + 1, &fdsetRecv, NULL, NULL, &timeout);
+        vnThreadsRunning[4]++;
+        if (fShutdown)
+            break;
+        if (nSelect == SOCKET_ERROR)
+        {
+            printf("ThreadWorkServer select failed: %d\n", WSAGetLastError());
+            Sleep(timeout.tv_usec/1000);
+            continue;
+        }
+
+        //
+        // Accept new workers
+        //
+        if (FD_ISSET(hWorkListenSocket, &fdsetRecv))
+        {
+            struct sockaddr_in sockaddr;
+#ifdef __WXMSW__
+            int len = sizeof(sockaddr);
+#else
+            socklen_t len = sizeof(sockaddr);
+#endif
+            SOCKET hSocket = accept(hWorkListenSocket, (struct sockaddr*)&sockaddr, &len);
+            if (hSocket == INVALID_SOCKET)
+            {
+                if (WSAGetLastError() != WSAEWOULDBLOCK)
+                    printf("ERROR ThreadWorkServer accept failed: %d\n", WSAGetLastError());
+            }
+            else
+            {
+#ifdef __WXMSW__
+                u_long nNonBlocking = 1;
+                if (ioctlsocket(hSocket, FIONBIO, &nNonBlocking) == SOCKET_ERROR)
+#else
+                if (fcntl(hSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR)
+#endif
+                {
+                    printf("ERROR ThreadWorkServer setting nonblocking failed: %d\n", WSAGetLastError());
+                    closesocket(hSocket);
+                }
+                else
+                {
+                    printf("work server accepted connection\n");
+                    mapClients[hSocket] = "";
+                }
+            }
+        }
+
+        //
+        // Answer each complete line
+        //
+        vector<SOCKET> vDisconnect;
+        for (map<SOCKET, string>::iterator mi = mapClients.begin(); mi != mapClients.end(); ++mi)
+        {
+            SOCKET hSocket = (*mi).first;
+            string& strBuf = (*mi).second;
+            if (!FD_ISSET(hSocket, &fdsetRecv))
+                continue;
+
+            char pchBuf[4096];
+            int nBytes = recv(hSocket, pchBuf, sizeof(pchBuf), 0);
+            if (nBytes <= 0)
+            {
+                int nErr = WSAGetLastError();
+                if (nBytes == 0 || (nErr != WSAEWOULDBLOCK && nErr != WSAEINTR && nErr != WSAEINPROGRESS))
+                    vDisconnect.push_back(hSocket);
+                continue;
+            }
+            strBuf.append(pchBuf, nBytes);
+
+            string::size_type nEnd;
+            while ((nEnd = strBuf.find('\n')) != string::npos)
+            {
+                string strLine = strBuf.substr(0, nEnd);
+                strBuf.erase(0, nEnd + 1);
+                if (!strLine.empty() && strLine[strLine.size()-1] == '\r')
+                    strLine.erase(strLine.size()-1);
+                string strReply = HandleWorkRequest(strLine);
+                if (!strReply.empty() && !Send(hSocket, strReply))
+                {
+                    vDisconnect.push_back(hSocket);
+                    break;
+                }
+            }
+
+            // Nothing we understand is this long
+            if (strBuf.size() > 1000)
+                vDisconnect.push_back(hSocket);
+        }
+        foreach(SOCKET hSocket, vDisconnect)
+        {
+            if (mapClients.erase(hSocket))
+            {
+                printf("work server connection closed\n");
+                closesocket(hSocket);
+            }
+        }
+    }
+
+    for (map<SOCKET, string>::iterator mi = mapClients.begin(); mi != mapClients.end(); ++mi)
+        closesocket((*mi).first);
+    closesocket(hWorkListenSocket);
+    hWorkListenSocket = INVALID_SOCKET;
+}
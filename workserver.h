@@ -0,0 +1,9 @@
+// Copyright (c) 2009 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+static const unsigned short DEFAULT_WORKSERVER_PORT = 8332;
+
+extern bool StartWorkServer(string& strError, unsigned short nPort=DEFAULT_WORKSERVER_PORT);
+extern void ThreadWorkServer(void* parg);
+extern string HandleWorkRequest(const string& strLine);